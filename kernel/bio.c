@@ -1,14 +1,17 @@
 // Buffer cache.
 //
-// The buffer cache is a linked list of buf structures holding
+// The buffer cache is a hash table of buf structures holding
 // cached copies of disk block contents.  Caching disk blocks
 // in memory reduces the number of disk reads and also provides
 // a synchronization point for disk blocks used by multiple processes.
 //
 // Interface:
 // * To get a buffer for a particular disk block, call bread.
-// * After changing buffer data, call bwrite to write it to disk.
+// * After changing buffer data, call bwrite to write it to disk,
+//     or bwritev to write several buffers with one disk submission.
 // * When done with the buffer, call brelse.
+// * To start reading a block that will be needed soon, without
+//     waiting for it, call breadahead.
 // * Do not use the buffer after calling brelse.
 // * Only one process at a time can use a buffer,
 //     so do not keep them longer than necessary.
@@ -23,67 +26,185 @@
 #include "fs.h"
 #include "buf.h"
 
+// Buffers are hashed by (dev, blockno) into NBUCKET buckets,
+// each with its own lock, so that lookups of different blocks
+// don't contend. A bucket lock protects the bucket's list and
+// the refcnt, lastuse, dev and blockno of the buffers on it.
+// Eviction picks the unreferenced buffer with the oldest
+// lastuse from any bucket and moves it to the target bucket;
+// it holds the two bucket locks in index order, so there is
+// no global lock.
+
+#define NBUCKET 13
+
 struct {
-  struct spinlock lock;
   struct buf buf[NBUF];
 
-  // Linked list of all buffers, through prev/next.
-  // head.next is most recently used.
-  struct buf head;
+  struct {
+    struct spinlock lock;
+    struct buf head;
+  } bucket[NBUCKET];
 } bcache;
 
+static uint
+bhash(uint dev, uint blockno)
+{
+  return (dev * 31 + blockno) % NBUCKET;
+}
+
+// Remove b from whatever bucket list it is on.
+// Caller holds that bucket's lock.
+static void
+bunlink(struct buf *b)
+{
+  b->next->prev = b->prev;
+  b->prev->next = b->next;
+}
+
+// Insert b at the front of bucket h.
+// Caller holds bcache.bucket[h].lock.
+static void
+blink(struct buf *b, int h)
+{
+  struct buf *head = &bcache.bucket[h].head;
+
+  b->next = head->next;
+  b->prev = head;
+  head->next->prev = b;
+  head->next = b;
+}
+
 void
 binit(void)
 {
   struct buf *b;
 
-  initlock(&bcache.lock, "bcache");
+  for(int i = 0; i < NBUCKET; i++){
+    initlock(&bcache.bucket[i].lock, "bcache.bucket");
+    bcache.bucket[i].head.prev = &bcache.bucket[i].head;
+    bcache.bucket[i].head.next = &bcache.bucket[i].head;
+  }
 
-  // Create linked list of buffers
-  bcache.head.prev = &bcache.head;
-  bcache.head.next = &bcache.head;
+  // All buffers start out as (dev 0, block 0) and not valid,
+  // so they all live in that block's bucket.
   for(b = bcache.buf; b < bcache.buf+NBUF; b++){
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
     initsleeplock(&b->lock, "buffer");
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
+    blink(b, bhash(b->dev, b->blockno));
   }
 }
 
-// Look through buffer cache for block on device dev.
-// If not found, allocate a buffer.
-// In either case, return locked buffer.
+// Look for block on device dev in bucket h.
+// Caller holds bcache.bucket[h].lock.
 static struct buf*
-bget(uint dev, uint blockno)
+blookup(int h, uint dev, uint blockno)
 {
-  struct buf *b;
+  struct buf *b, *head = &bcache.bucket[h].head;
 
-  acquire(&bcache.lock);
-
-  // Is the block already cached?
-  for(b = bcache.head.next; b != &bcache.head; b = b->next){
-    if(b->dev == dev && b->blockno == blockno){
-      b->refcnt++;
-      release(&bcache.lock);
-      acquiresleep(&b->lock);
+  for(b = head->next; b != head; b = b->next){
+    if(b->dev == dev && b->blockno == blockno)
       return b;
+  }
+  return 0;
+}
+
+// Find the least recently used unreferenced buffer, scanning
+// one bucket at a time. The result is only a hint, since all
+// locks are dropped before returning; *vh is set to the bucket
+// it was found in.
+static struct buf*
+bvictim(int *vh)
+{
+  struct buf *b, *head, *victim = 0;
+
+  for(int i = 0; i < NBUCKET; i++){
+    acquire(&bcache.bucket[i].lock);
+    head = &bcache.bucket[i].head;
+    for(b = head->next; b != head; b = b->next){
+      if(b->refcnt == 0 && (victim == 0 || b->lastuse < victim->lastuse)){
+        victim = b;
+        *vh = i;
+      }
     }
+    release(&bcache.bucket[i].lock);
   }
+  return victim;
+}
 
-  // Not cached; recycle an unused buffer.
-  for(b = bcache.head.prev; b != &bcache.head; b = b->prev){
-    if(b->refcnt == 0) {
+// Block (dev, blockno), which hashes to bucket h, was not
+// cached; recycle the least recently used unused buffer for it.
+// Return the locked buffer, or 0 if every buffer is in use.
+static struct buf*
+brecycle(uint dev, uint blockno, int h)
+{
+  struct buf *b;
+  int vh = 0, lo, hi;
+
+  for(;;){
+    if((b = bvictim(&vh)) == 0)
+      return 0;
+
+    lo = vh < h ? vh : h;
+    hi = vh < h ? h : vh;
+    acquire(&bcache.bucket[lo].lock);
+    if(hi != lo)
+      acquire(&bcache.bucket[hi].lock);
+
+    // Someone else may have cached the block while we
+    // held no locks.
+    struct buf *b0;
+    if((b0 = blookup(h, dev, blockno)) != 0){
+      b0->refcnt++;
+      if(hi != lo)
+        release(&bcache.bucket[hi].lock);
+      release(&bcache.bucket[lo].lock);
+      acquiresleep(&b0->lock);
+      return b0;
+    }
+
+    // The victim may have been taken or moved meanwhile;
+    // its bucket is only stable while we hold the lock.
+    if(b->refcnt == 0 && bhash(b->dev, b->blockno) == vh){
+      bunlink(b);
       b->dev = dev;
       b->blockno = blockno;
       b->valid = 0;
       b->refcnt = 1;
-      release(&bcache.lock);
+      blink(b, h);
+      if(hi != lo)
+        release(&bcache.bucket[hi].lock);
+      release(&bcache.bucket[lo].lock);
       acquiresleep(&b->lock);
       return b;
     }
+
+    if(hi != lo)
+      release(&bcache.bucket[hi].lock);
+    release(&bcache.bucket[lo].lock);
+  }
+}
+
+// Look through buffer cache for block on device dev.
+// If not found, allocate a buffer.
+// In either case, return locked buffer.
+static struct buf*
+bget(uint dev, uint blockno)
+{
+  struct buf *b;
+  int h = bhash(dev, blockno);
+
+  // Is the block already cached?
+  acquire(&bcache.bucket[h].lock);
+  if((b = blookup(h, dev, blockno)) != 0){
+    b->refcnt++;
+    release(&bcache.bucket[h].lock);
+    acquiresleep(&b->lock);
+    return b;
   }
-  panic("bget: no buffers");
+  release(&bcache.bucket[h].lock);
+
+  if((b = brecycle(dev, blockno, h)) == 0)
+    panic("bget: no buffers");
+  return b;
 }
 
 // Return a locked buf with the contents of the indicated block.
@@ -100,6 +221,56 @@ bread(uint dev, uint blockno)
   return b;
 }
 
+// Start reading the indicated block into the cache, unless
+// it is already there, and return without waiting. The buffer
+// stays locked until the read completes; virtio_disk_intr()
+// then calls breaddone() to unlock and release it, so a later
+// bread() of the block simply waits for the data.
+// Gives up quietly if every buffer is in use.
+void
+breadahead(uint dev, uint blockno)
+{
+  struct buf *b;
+  int h = bhash(dev, blockno);
+
+  acquire(&bcache.bucket[h].lock);
+  b = blookup(h, dev, blockno);
+  release(&bcache.bucket[h].lock);
+  if(b != 0)
+    return;
+
+  if((b = brecycle(dev, blockno, h)) == 0)
+    return;
+  if(b->valid){
+    // someone else read it in meanwhile.
+    brelse(b);
+    return;
+  }
+  b->async = 1;
+  virtio_disk_submit(b->dev, b, 0);
+  virtio_disk_kick(b->dev);
+}
+
+// The disk has finished a read started by breadahead().
+// Called from the disk interrupt, which holds no
+// buffer locks, so b's sleep-lock is released directly.
+void
+breaddone(struct buf *b)
+{
+  int h;
+
+  b->async = 0;
+  b->valid = 1;
+  releasesleep(&b->lock);
+
+  h = bhash(b->dev, b->blockno);
+  acquire(&bcache.bucket[h].lock);
+  b->refcnt--;
+  if(b->refcnt == 0)
+    b->lastuse = ticks;
+  release(&bcache.bucket[h].lock);
+}
+
 // Write b's contents to disk.  Must be locked.
 void
 bwrite(struct buf *b)
@@ -109,43 +280,61 @@ bwrite(struct buf *b)
   virtio_disk_rw(b->dev, b, 1);
 }
 
+// Write the locked buffers bs[0..n-1] to disk. All the
+// writes are queued before the device is notified, so the
+// disk can work on them together. Returns when all are done.
+void
+bwritev(struct buf **bs, int n)
+{
+  int i;
+
+  for(i = 0; i < n; i++){
+    if(!holdingsleep(&bs[i]->lock))
+      panic("bwritev");
+    virtio_disk_submit(bs[i]->dev, bs[i], 1);
+  }
+  for(i = 0; i < n; i++)
+    virtio_disk_kick(bs[i]->dev);
+  for(i = 0; i < n; i++)
+    virtio_disk_wait(bs[i]->dev, bs[i]);
+}
+
 // Release a locked buffer.
-// Move to the head of the MRU list.
+// Record when it was last used, for bget()'s eviction.
 void
 brelse(struct buf *b)
 {
+  int h;
+
   if(!holdingsleep(&b->lock))
     panic("brelse");
 
   releasesleep(&b->lock);
 
-  acquire(&bcache.lock);
+  h = bhash(b->dev, b->blockno);
+  acquire(&bcache.bucket[h].lock);
   b->refcnt--;
   if (b->refcnt == 0) {
     // no one is waiting for it.
-    b->next->prev = b->prev;
-    b->prev->next = b->next;
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
+    b->lastuse = ticks;
   }
-  
-  release(&bcache.lock);
+  release(&bcache.bucket[h].lock);
 }
 
 void
 bpin(struct buf *b) {
-  acquire(&bcache.lock);
+  int h = bhash(b->dev, b->blockno);
+
+  acquire(&bcache.bucket[h].lock);
   b->refcnt++;
-  release(&bcache.lock);
+  release(&bcache.bucket[h].lock);
 }
 
 void
 bunpin(struct buf *b) {
-  acquire(&bcache.lock);
+  int h = bhash(b->dev, b->blockno);
+
+  acquire(&bcache.bucket[h].lock);
   b->refcnt--;
-  release(&bcache.lock);
+  release(&bcache.bucket[h].lock);
 }
-
-
@@ -9,7 +9,8 @@
 
 static int nsizes;     // the number of entries in bd_sizes array
 
-#define LEAF_SIZE     16                         // The smallest block size
+#define LEAF_SHIFT    4
+#define LEAF_SIZE     (1 << LEAF_SHIFT)          // The smallest block size
 #define MAXSIZE       (nsizes-1)                 // Largest index in bd_sizes array
 #define BLK_SIZE(k)   ((1L << (k)) * LEAF_SIZE)  // Size of block at size k
 #define HEAP_SIZE     BLK_SIZE(MAXSIZE) 
@@ -19,11 +20,15 @@ static int nsizes;     // the number of entries in bd_sizes array
 typedef struct list Bd_list;
 
 // The allocator has sz_info for each size k. Each sz_info has a free
-// list, an array alloc to keep track which blocks have been
-// allocated, and an split array to to keep track which blocks have
-// been split.  The arrays are of type char (which is 1 byte), but the
-// allocator uses 1 bit per block (thus, one char records the info of
-// 8 blocks).
+// list, an array alloc with one bit per pair of buddies, and an
+// split array to to keep track which blocks have been split.  The
+// arrays are of type char (which is 1 byte), but the allocator uses
+// 1 bit per pair or block (thus, one char records the info of 8).
+//
+// A pair's alloc bit is the XOR of the two buddies' allocated
+// states, flipped whenever either is allocated or freed. When
+// one buddy is freed, a clear bit after the flip means the other
+// is free too, so the pair can merge without looking it up.
 struct sz_info {
   Bd_list free;
   char *alloc;
@@ -34,26 +39,57 @@ typedef struct sz_info Sz_info;
 static Sz_info *bd_sizes; 
 static void *bd_base;   // start address of memory managed by the buddy allocator
 static struct spinlock lock;
+static uint64 nonempty; // bit k is set if bd_sizes[k].free isn't empty
+static uint64 nfree;    // free bytes, for sys_bdtest()
+
+// bd_init() hands out nothing in [bd_base, bd_meta) or [bd_end, HEAP_SIZE).
+static void *bd_meta;
+static void *bd_end;
 
 // Return 1 if bit at position index in array is set to 1
-int bit_isset(char *array, int index) {
-  char b = array[index/8];
-  char m = (1 << (index % 8));
-  return (b & m) == m;
+static inline int bit_isset(char *array, int index) {
+  return (array[index >> 3] >> (index & 7)) & 1;
 }
 
 // Set bit at position index in array to 1
-void bit_set(char *array, int index) {
-  char b = array[index/8];
-  char m = (1 << (index % 8));
-  array[index/8] = (b | m);
+static inline void bit_set(char *array, int index) {
+  array[index >> 3] |= 1 << (index & 7);
 }
 
 // Clear bit at position index in array
-void bit_clear(char *array, int index) {
-  char b = array[index/8];
-  char m = (1 << (index % 8));
-  array[index/8] = (b & ~m);
+static inline void bit_clear(char *array, int index) {
+  array[index >> 3] &= ~(1 << (index & 7));
+}
+
+// Flip bit at position index in array, and return its new value
+static inline int bit_toggle(char *array, int index) {
+  array[index >> 3] ^= 1 << (index & 7);
+  return bit_isset(array, index);
+}
+
+// Free list operations that keep nonempty up to date.
+static void
+bd_push(int k, void *p)
+{
+  lst_push(&bd_sizes[k].free, p);
+  nonempty |= 1L << k;
+}
+
+static void *
+bd_pop(int k)
+{
+  void *p = lst_pop(&bd_sizes[k].free);
+  if(lst_empty(&bd_sizes[k].free))
+    nonempty &= ~(1L << k);
+  return p;
+}
+
+static void
+bd_remove(int k, void *p)
+{
+  lst_remove(p);
+  if(lst_empty(&bd_sizes[k].free))
+    nonempty &= ~(1L << k);
 }
 
 // Print a bit vector as a list of ranges of 1 bits
@@ -83,8 +119,8 @@ bd_print() {
   for (int k = 0; k < nsizes; k++) {
     printf("size %d (blksz %d nblk %d): free list: ", k, BLK_SIZE(k), NBLK(k));
     lst_print(&bd_sizes[k].free);
-    printf("  alloc:");
-    bd_print_vector(bd_sizes[k].alloc, NBLK(k));
+    printf("  alloc pairs:");
+    bd_print_vector(bd_sizes[k].alloc, (NBLK(k)+1)/2);
     if(k > 0) {
       printf("  split:");
       bd_print_vector(bd_sizes[k].split, NBLK(k));
@@ -92,30 +128,25 @@ bd_print() {
   }
 }
 
-// What is the first k such that 2^k >= n?
+// What is the first k such that BLK_SIZE(k) >= n?
 int
 firstk(uint64 n) {
-  int k = 0;
-  uint64 size = LEAF_SIZE;
+  uint64 nleaf = (n + LEAF_SIZE - 1) >> LEAF_SHIFT;
 
-  while (size < n) {
-    k++;
-    size *= 2;
-  }
-  return k;
+  if(nleaf <= 1)
+    return 0;
+  return 64 - __builtin_clzl(nleaf - 1);
 }
 
 // Compute the block index for address p at size k
 int
 blk_index(int k, char *p) {
-  int n = p - (char *) bd_base;
-  return n / BLK_SIZE(k);
+  return (p - (char *) bd_base) >> (k + LEAF_SHIFT);
 }
 
 // Convert a block index at size k back into an address
 void *addr(int k, int bi) {
-  int n = bi * BLK_SIZE(k);
-  return (char *) bd_base + n;
+  return (char *) bd_base + ((uint64) bi << (k + LEAF_SHIFT));
 }
 
 // allocate nbytes, but malloc won't return anything smaller than LEAF_SIZE
@@ -126,27 +157,27 @@ bd_malloc(uint64 nbytes)
 
   acquire(&lock);
 
-  // Find a free block >= nbytes, starting with smallest k possible
+  // Find a free block >= nbytes: the smallest nonempty size >= fk
   fk = firstk(nbytes);
-  for (k = fk; k < nsizes; k++) {
-    if(!lst_empty(&bd_sizes[k].free))
-      break;
-  }
-  if(k >= nsizes) { // No free blocks?
+  uint64 m = fk < 64 ? nonempty & (~0UL << fk) : 0;
+  if(m == 0) { // No free blocks?
     release(&lock);
     return 0;
   }
+  k = __builtin_ctzl(m);
 
   // Found a block; pop it and potentially split it.
-  char *p = lst_pop(&bd_sizes[k].free);
-  bit_set(bd_sizes[k].alloc, blk_index(k, p));
+  char *p = bd_pop(k);
+  nfree -= BLK_SIZE(fk);
+  if(k < MAXSIZE)
+    bit_toggle(bd_sizes[k].alloc, blk_index(k, p) >> 1);
   for(; k > fk; k--) {
-    // split a block at size k and mark one half allocated at size k-1
+    // split a block at size k, allocate one half at size k-1
     // and put the buddy on the free list at size k-1
     char *q = p + BLK_SIZE(k-1);   // p's buddy
     bit_set(bd_sizes[k].split, blk_index(k, p));
-    bit_set(bd_sizes[k-1].alloc, blk_index(k-1, p));
-    lst_push(&bd_sizes[k-1].free, q);
+    bit_toggle(bd_sizes[k-1].alloc, blk_index(k-1, p) >> 1);
+    bd_push(k-1, q);
   }
   release(&lock);
 
@@ -156,12 +187,12 @@ bd_malloc(uint64 nbytes)
 // Find the size of the block that p points to.
 int
 size(char *p) {
-  for (int k = 0; k < nsizes; k++) {
+  for (int k = 0; k < MAXSIZE; k++) {
     if(bit_isset(bd_sizes[k+1].split, blk_index(k+1, p))) {
       return k;
     }
   }
-  return 0;
+  return MAXSIZE;
 }
 
 // Free memory pointed to by p, which was earlier allocated using
@@ -172,24 +203,25 @@ bd_free(void *p) {
   int k;
 
   acquire(&lock);
-  for (k = size(p); k < MAXSIZE; k++) {
+  k = size(p);
+  nfree += BLK_SIZE(k);
+  for (; k < MAXSIZE; k++) {
     int bi = blk_index(k, p);
-    int buddy = (bi % 2 == 0) ? bi+1 : bi-1;
-    bit_clear(bd_sizes[k].alloc, bi);  // free p at size k
-    if (bit_isset(bd_sizes[k].alloc, buddy)) {  // is buddy allocated?
+    // free p at size k; a set bit means buddy is still allocated
+    if (bit_toggle(bd_sizes[k].alloc, bi >> 1)) {
       break;   // break out of loop
     }
-    // budy is free; merge with buddy
-    q = addr(k, buddy);
-    lst_remove(q);    // remove buddy from free list
-    if(buddy % 2 == 0) {
+    // buddy is free; merge with buddy
+    q = addr(k, bi ^ 1);
+    bd_remove(k, q);    // remove buddy from free list
+    if(bi & 1) {
       p = q;
     }
     // at size k+1, mark that the merged buddy pair isn't split
     // anymore
     bit_clear(bd_sizes[k+1].split, blk_index(k+1, p));
   }
-  lst_push(&bd_sizes[k].free, p);
+  bd_push(k, p);
   release(&lock);
 }
 
@@ -204,15 +236,13 @@ blk_index_next(int k, char *p) {
 
 int
 log2(uint64 n) {
-  int k = 0;
-  while (n > 1) {
-    k++;
-    n = n >> 1;
-  }
-  return k;
+  if (n <= 1)
+    return 0;
+  return 63 - __builtin_clzl(n);
 }
 
-// Mark memory from [start, stop), starting at size 0, as allocated. 
+// Mark memory from [start, stop), starting at size 0, as allocated:
+// every block above size 0 that overlaps it is split.
 void
 bd_mark(void *start, void *stop)
 {
@@ -221,32 +251,36 @@ bd_mark(void *start, void *stop)
   if (((uint64) start % LEAF_SIZE != 0) || ((uint64) stop % LEAF_SIZE != 0))
     panic("bd_mark");
 
-  for (int k = 0; k < nsizes; k++) {
+  for (int k = 1; k < nsizes; k++) {
     bi = blk_index(k, start);
     bj = blk_index_next(k, stop);
     for(; bi < bj; bi++) {
-      if(k > 0) {
-        // if a block is allocated at size k, mark it as split too.
-        bit_set(bd_sizes[k].split, bi);
-      }
-      bit_set(bd_sizes[k].alloc, bi);
+      bit_set(bd_sizes[k].split, bi);
     }
   }
 }
 
+// Does block bi at size k overlap memory marked by bd_init()?
+static int
+bd_reserved(int k, int bi) {
+  char *a = addr(k, bi);
+  return a < (char *) bd_meta || a + BLK_SIZE(k) > (char *) bd_end;
+}
+
 // If a block is marked as allocated and the buddy is free, put the
 // buddy on the free list at size k.
 int
 bd_initfree_pair(int k, int bi) {
-  int buddy = (bi % 2 == 0) ? bi+1 : bi-1;
+  int buddy = bi ^ 1;
   int free = 0;
-  if(bit_isset(bd_sizes[k].alloc, bi) !=  bit_isset(bd_sizes[k].alloc, buddy)) {
+  if(bd_reserved(k, bi) != bd_reserved(k, buddy)) {
     // one of the pair is free
     free = BLK_SIZE(k);
-    if(bit_isset(bd_sizes[k].alloc, bi))
-      lst_push(&bd_sizes[k].free, addr(k, buddy));   // put buddy on free list
+    bit_toggle(bd_sizes[k].alloc, bi >> 1);
+    if(bd_reserved(k, bi))
+      bd_push(k, addr(k, buddy));   // put buddy on free list
     else
-      lst_push(&bd_sizes[k].free, addr(k, bi));      // put bi on free list
+      bd_push(k, addr(k, bi));      // put bi on free list
   }
   return free;
 }
@@ -262,7 +296,8 @@ bd_initfree(void *bd_left, void *bd_right) {
     int left = blk_index_next(k, bd_left);
     int right = blk_index(k, bd_right);
     free += bd_initfree_pair(k, left);
-    if(right <= left)
+    // skip a right edge past the heap, or in left's pair
+    if(right <= left || right >= NBLK(k) || (right >> 1) == (left >> 1))
       continue;
     free += bd_initfree_pair(k, right);
   }
@@ -286,8 +321,8 @@ bd_mark_unavailable(void *end, void *left) {
     unavailable = ROUNDUP(unavailable, LEAF_SIZE);
   printf("bd: 0x%x bytes unavailable\n", unavailable);
 
-  void *bd_end = bd_base+BLK_SIZE(MAXSIZE)-unavailable;
-  bd_mark(bd_end, bd_base+BLK_SIZE(MAXSIZE));
+  void *limit = bd_base+BLK_SIZE(MAXSIZE)-unavailable;
+  bd_mark(limit, bd_base+BLK_SIZE(MAXSIZE));
   return unavailable;
 }
 
@@ -317,7 +352,7 @@ bd_init(void *base, void *end) {
   // initialize free list and allocate the alloc array for each size k
   for (int k = 0; k < nsizes; k++) {
     lst_init(&bd_sizes[k].free);
-    sz = sizeof(char)* ROUNDUP(NBLK(k), 8)/8;
+    sz = sizeof(char)* ROUNDUP(NBLK(k), 16)/16;
     bd_sizes[k].alloc = p;
     memset(bd_sizes[k].alloc, 0, sz);
     p += sz;
@@ -336,14 +371,16 @@ bd_init(void *base, void *end) {
   // done allocating; mark the memory range [base, p) as allocated, so
   // that buddy will not hand out that memory.
   int meta = bd_mark_data_structures(p);
+  bd_meta = p;
   
   // mark the unavailable memory range [end, HEAP_SIZE) as allocated,
   // so that buddy will not hand out that memory.
   int unavailable = bd_mark_unavailable(end, p);
-  void *bd_end = bd_base+BLK_SIZE(MAXSIZE)-unavailable;
+  bd_end = bd_base+BLK_SIZE(MAXSIZE)-unavailable;
   
   // initialize free lists for each size k
   int free = bd_initfree(p, bd_end);
+  nfree = free;
 
   // check if the amount that is free is what we expect
   if(free != BLK_SIZE(MAXSIZE)-meta-unavailable) {
@@ -352,3 +389,62 @@ bd_init(void *base, void *end) {
   }
 }
 
+
+// For alloctest. With n > 0, make n random allocations and
+// frees of blocks from LEAF_SIZE to 1024 leaves, so that blocks
+// of many sizes are split and merged, then free them all;
+// returns -1 if a block's contents were disturbed while it was
+// allocated, else 0. With n == 0, returns the number of free
+// bytes; with n < 0, the size of the largest free block.
+#define NBDTEST 32
+
+// the byte sys_bdtest() fills block j at p with.
+static char
+bdpat(char *p, int j)
+{
+  return ((uint64)p >> LEAF_SHIFT) + j;
+}
+
+uint64
+sys_bdtest(void)
+{
+  char *blk[NBDTEST];
+  int sz[NBDTEST];
+  int n, i, j, bad;
+  uint seed;
+  uint64 r;
+
+  if(argint(0, &n) < 0)
+    return -1;
+  if(n <= 0){
+    acquire(&lock);
+    if(n == 0)
+      r = nfree;
+    else
+      r = nonempty ? BLK_SIZE(63 - __builtin_clzl(nonempty)) : 0;
+    release(&lock);
+    return r;
+  }
+
+  // each process's kernel stack is at its own address.
+  seed = ticks ^ (uint64)&seed;
+  bad = 0;
+  memset(blk, 0, sizeof(blk));
+  for(i = 0; i < n + NBDTEST; i++){
+    seed = seed * 1103515245 + 12345;
+    // the last NBDTEST rounds free whatever is left.
+    j = i < n ? (seed >> 8) % NBDTEST : i - n;
+    if(blk[j]){
+      for(int b = 0; b < sz[j]; b++)
+        if(blk[j][b] != bdpat(blk[j], j))
+          bad = 1;
+      bd_free(blk[j]);
+      blk[j] = 0;
+    } else if(i < n){
+      sz[j] = LEAF_SIZE << ((seed >> 16) % 11);
+      if((blk[j] = bd_malloc(sz[j])) != 0)
+        memset(blk[j], bdpat(blk[j], j), sz[j]);
+    }
+  }
+  return bad ? -1 : 0;
+}
@@ -1,11 +1,13 @@
 struct buf {
   int valid;   // has data been read from disk?
   int disk;    // does disk "own" buf?
+  int async;   // read-ahead: release when the read completes
   uint dev;
   uint blockno;
   struct sleeplock lock;
   uint refcnt;
-  struct buf *prev; // LRU cache list
+  uint lastuse;     // ticks at last brelse(), for LRU eviction
+  struct buf *prev; // hash bucket list
   struct buf *next;
   uchar data[BSIZE];
 };
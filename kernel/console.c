@@ -27,22 +27,19 @@
 
 //
 // send one character to the uart.
+// called by printf, and to echo input characters,
+// but not from write(). it spins rather than
+// sleeping, so it can be used with locks held
+// and in interrupts.
 //
 void
 consputc(int c)
 {
-  extern volatile int panicked; // from printf.c
-
-  if(panicked){
-    for(;;)
-      ;
-  }
-
   if(c == BACKSPACE){
     // if the user typed backspace, overwrite with a space.
-    uartputc('\b'); uartputc(' '); uartputc('\b');
+    uartputc_sync('\b'); uartputc_sync(' '); uartputc_sync('\b');
   } else {
-    uartputc(c);
+    uartputc_sync(c);
   }
 }
 
@@ -59,20 +56,26 @@ struct {
 
 //
 // user write()s to the console go here.
+// characters go into the uart's transmit buffer, so a
+// writer only waits (sleeping) when that is full, and
+// writers don't hold cons.lock, which input needs.
 //
 int
 consolewrite(struct file *f, int user_src, uint64 src, int n)
 {
-  int i;
-
-  acquire(&cons.lock);
-  for(i = 0; i < n; i++){
-    char c;
-    if(either_copyin(&c, user_src, src+i, 1) == -1)
+  int i, j, m;
+  char buf[64];
+
+  for(i = 0; i < n; i += m){
+    // copy in a chunk at a time, not a character at a time.
+    m = n - i;
+    if(m > sizeof(buf))
+      m = sizeof(buf);
+    if(either_copyin(buf, user_src, src+i, m) == -1)
       break;
-    consputc(c);
+    for(j = 0; j < m; j++)
+      uartputc(buf[j]);
   }
-  release(&cons.lock);
 
   return n;
 }
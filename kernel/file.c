@@ -12,17 +12,22 @@
 #include "file.h"
 #include "stat.h"
 #include "proc.h"
+#include "slab.h"
 
 struct devsw devsw[NDEV];
+// Files come from a slab cache, so there is no fixed limit
+// on how many can be open. ftable.lock protects f->ref.
 struct {
   struct spinlock lock;
-  struct file file[NFILE];
 } ftable;
 
+static struct slabcache filecache;
+
 void
 fileinit(void)
 {
   initlock(&ftable.lock, "ftable");
+  slabinit(&filecache, "file", sizeof(struct file));
 }
 
 // Allocate a file structure.
@@ -31,16 +36,11 @@ filealloc(void)
 {
   struct file *f;
 
-  acquire(&ftable.lock);
-  for(f = ftable.file; f < ftable.file + NFILE; f++){
-    if(f->ref == 0){
-      f->ref = 1;
-      release(&ftable.lock);
-      return f;
-    }
-  }
-  release(&ftable.lock);
-  return 0;
+  if((f = slaballoc(&filecache)) == 0)
+    return 0;
+  memset(f, 0, sizeof(*f));
+  f->ref = 1;
+  return f;
 }
 
 // Increment ref count for file f.
@@ -69,9 +69,8 @@ fileclose(struct file *f)
     return;
   }
   ff = *f;
-  f->ref = 0;
-  f->type = FD_NONE;
   release(&ftable.lock);
+  slabfree(&filecache, f);
 
   if(ff.type == FD_PIPE){
     pipeclose(ff.pipe, ff.writable);
@@ -119,8 +118,34 @@ fileread(struct file *f, uint64 addr, int n)
     r = devsw[f->major].read(f, 1, addr, n);
   } else if(f->type == FD_INODE){
     ilock(f->ip);
-    if((r = readi(f->ip, 1, addr, f->off, n)) > 0)
-      f->off += r;
+    if(f->off != f->ranext){
+      if((r = readi(f->ip, 1, addr, f->off, n)) > 0)
+        f->off += r;
+    } else {
+      // reading on from where the last read stopped: read
+      // NREADAHEAD blocks at a time, starting the disk on the
+      // next ones before copying out each piece, so that the
+      // blocks read ahead stay cached until readi() gets there.
+      int max = NREADAHEAD * BSIZE;
+      while(r < n){
+        int n1 = n - r;
+        if(n1 > max)
+          n1 = max;
+
+        ireadahead(f->ip, f->off, n1);
+        int r1 = readi(f->ip, 1, addr + r, f->off, n1);
+        if(r1 <= 0){
+          if(r == 0)
+            r = r1;
+          break;
+        }
+        f->off += r1;
+        r += r1;
+        if(r1 < n1)
+          break;  // end of file
+      }
+    }
+    f->ranext = f->off;
     iunlock(f->ip);
   } else {
     panic("fileread");
@@ -6,6 +6,7 @@ struct file {
   struct pipe *pipe; // FD_PIPE
   struct inode *ip;  // FD_INODE and FD_DEVICE
   uint off;          // FD_INODE and FD_DEVICE
+  uint ranext;       // FD_INODE: off after the last read, for read-ahead
   short major;       // FD_DEVICE
   short minor;       // FD_DEVICE
 };
@@ -19,6 +20,9 @@ struct inode {
   uint dev;           // Device number
   uint inum;          // Inode number
   int ref;            // Reference count
+  struct inode *hnext;   // icache hash chain
+  struct inode *lrunext; // icache LRU list, while ref is 0
+  struct inode *lruprev;
   struct sleeplock lock; // protects everything below here
   int valid;          // inode has been read from disk?
 
@@ -27,7 +31,11 @@ struct inode {
   short minor;
   short nlink;
   uint size;
-  uint addrs[NDIRECT+1];
+  uint addrs[NDIRECT+2];
+  uint runbn;         // cached run of contiguous blocks:
+  uint runaddr;       //   file blocks [runbn, runbn+runlen)
+  uint runlen;        //   are at [runaddr, runaddr+runlen)
+  uint lastalloc;     // block bmap() allocated last, or 0
 };
 
 // map major device number to device functions.
@@ -23,6 +23,10 @@
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
 static void itrunc(struct inode*);
+static void bsuminit(int);
+static void isuminit(int);
+static void dcinit(void);
+static void dcpurge(uint, uint);
 // there should be one superblock per disk device, but we run with
 // only one device
 struct superblock sb; 
@@ -45,6 +49,8 @@ fsinit(int dev) {
   if(sb.magic != FSMAGIC)
     panic("invalid file system");
   initlog(dev, &sb);
+  bsuminit(dev);
+  isuminit(dev);
 }
 
 // Zero a block.
@@ -61,29 +67,105 @@ bzero(int dev, int bno)
 
 // Blocks.
 
-// Allocate a zeroed disk block.
-static uint
-balloc(uint dev)
+// In-memory summary of the free-block bitmap, one entry per
+// bitmap block, so that balloc() can skip full bitmap blocks
+// and start each search at the first bit that may be free.
+// An entry is only changed while holding its bitmap block's
+// buffer, so it always agrees with the bitmap; bsum.lock
+// makes the updates atomic for readers that don't hold it.
+#define NBMAP (FSSIZE / BPB + 1)
+
+struct {
+  struct spinlock lock;
+  uint nfree[NBMAP];   // free blocks in each bitmap block
+  uint hint[NBMAP];    // no free bit below this one
+  uint cur;            // bitmap block of the last allocation
+} bsum;
+
+// Build the summary from the on-disk bitmap.
+static void
+bsuminit(int dev)
 {
-  int b, bi, m;
   struct buf *bp;
+  uint b, bi, n;
 
-  bp = 0;
+  initlock(&bsum.lock, "bsum");
+  if(sb.size > NBMAP * BPB)
+    panic("bsuminit: file system too big");
   for(b = 0; b < sb.size; b += BPB){
     bp = bread(dev, BBLOCK(b, sb));
+    n = 0;
     for(bi = 0; bi < BPB && b + bi < sb.size; bi++){
-      m = 1 << (bi % 8);
-      if((bp->data[bi/8] & m) == 0){  // Is block free?
-        bp->data[bi/8] |= m;  // Mark block in use.
-        log_write(bp);
-        brelse(bp);
-        bzero(dev, b + bi);
-        return b + bi;
-      }
+      if((bp->data[bi/8] & (1 << (bi % 8))) == 0)
+        n++;
     }
     brelse(bp);
+    bsum.nfree[b / BPB] = n;
+    bsum.hint[b / BPB] = 0;
+  }
+}
+
+// Allocate the first free block at or after bit "from" of
+// bitmap block i. Returns the block number, or 0 if there
+// is none (block 0 is the boot block, never free).
+static uint
+bclaim(uint dev, uint i, uint from)
+{
+  struct buf *bp;
+  uint b = i * BPB, bi;
+  int m;
+
+  bp = bread(dev, BBLOCK(b, sb));
+  for(bi = from; bi < BPB && b + bi < sb.size; bi++){
+    // skip whole bytes of allocated blocks.
+    if(bi % 8 == 0 && bp->data[bi/8] == 0xff){
+      bi += 7;
+      continue;
+    }
+    m = 1 << (bi % 8);
+    if((bp->data[bi/8] & m) == 0){  // Is block free?
+      bp->data[bi/8] |= m;  // Mark block in use.
+      log_write(bp);
+      acquire(&bsum.lock);
+      bsum.nfree[i]--;
+      if(from <= bsum.hint[i])
+        bsum.hint[i] = bi + 1;
+      bsum.cur = i;
+      release(&bsum.lock);
+      brelse(bp);
+      return b + bi;
+    }
+  }
+  brelse(bp);
+  return 0;
+}
+
+// Allocate a zeroed disk block, preferably the first free one
+// at or after goal, so that files get contiguous blocks.
+static uint
+balloc(uint dev, uint goal)
+{
+  uint i, n, b;
+
+  if(goal > 0 && goal < sb.size && bsum.nfree[goal / BPB] > 0){
+    if((b = bclaim(dev, goal / BPB, goal % BPB)) != 0)
+      goto found;
+  }
+
+  // the bitmap block of the last allocation first, then the rest.
+  n = (sb.size + BPB - 1) / BPB;
+  for(i = 0; i < n; i++){
+    uint bi = (bsum.cur + i) % n;
+    if(bsum.nfree[bi] == 0)
+      continue;
+    if((b = bclaim(dev, bi, bsum.hint[bi])) != 0)
+      goto found;
   }
   panic("balloc: out of blocks");
+
+found:
+  bzero(dev, b);
+  return b;
 }
 
 // Free a disk block.
@@ -100,6 +182,11 @@ bfree(int dev, uint b)
     panic("freeing free block");
   bp->data[bi/8] &= ~m;
   log_write(bp);
+  acquire(&bsum.lock);
+  bsum.nfree[b / BPB]++;
+  if(bi < bsum.hint[b / BPB])
+    bsum.hint[b / BPB] = bi;
+  release(&bsum.lock);
   brelse(bp);
 }
 
@@ -133,13 +220,18 @@ bfree(int dev, uint b)
 //   the number of in-memory pointers to the entry (open
 //   files and current directories). iget() finds or
 //   creates a cache entry and increments its ref; iput()
-//   decrements ref.
+//   decrements ref. A free entry keeps its inode, still
+//   valid, until iget() recycles it for another one.
 //
 // * Valid: the information (type, size, &c) in an inode
 //   cache entry is only correct when ip->valid is 1.
-//   ilock() reads the inode from
-//   the disk and sets ip->valid, while iput() clears
-//   ip->valid if ip->ref has fallen to zero.
+//   ilock() reads the inode from the disk and sets
+//   ip->valid. An entry stays valid after its ref falls to
+//   zero, while it waits on the LRU list, so a later iget()
+//   of the same inode finds it in its hash bucket and
+//   ilock() needn't read the disk again. ip->valid is
+//   cleared only when iget() recycles the entry for another
+//   inode, or when iput() frees the inode on disk.
 //
 // * Locked: file system code may only examine and modify
 //   the information in an inode and its content if it
@@ -163,53 +255,237 @@ bfree(int dev, uint b)
 // have locked the inodes involved; this lets callers create
 // multi-step atomic operations.
 //
-// The icache.lock spin-lock protects the allocation of icache
-// entries. Since ip->ref indicates whether an entry is free,
-// and ip->dev and ip->inum indicate which i-node an entry
-// holds, one must hold icache.lock while using any of those fields.
+// Entries are hashed by (dev, inum) into NIBUCKET buckets,
+// each with its own lock. Since ip->ref indicates whether an
+// entry is free, and ip->dev and ip->inum indicate which
+// i-node an entry holds, one must hold the lock of the entry's
+// bucket while using any of those fields, or ip->hnext.
+//
+// Free entries are also on an LRU list, most recently freed
+// first, protected by icache.lrulock. An entry is on the list
+// exactly when its ref is zero. iget() recycles the entry at
+// the tail; like bget(), it then holds the two bucket locks
+// in index order. A bucket lock is acquired before lrulock.
 //
 // An ip->lock sleep-lock protects all ip-> fields other than ref,
-// dev, and inum.  One must hold ip->lock in order to
+// dev, inum and the list links.  One must hold ip->lock in order to
 // read or write that inode's ip->valid, ip->size, ip->type, &c.
 
+#define NIBUCKET 13
+
 struct {
-  struct spinlock lock;
   struct inode inode[NINODE];
+
+  struct {
+    struct spinlock lock;
+    struct inode *head;
+  } bucket[NIBUCKET];
+
+  struct spinlock lrulock;
+  struct inode *lruhead;   // most recently freed
+  struct inode *lrutail;   // next to recycle
 } icache;
 
+static uint
+ihash(uint dev, uint inum)
+{
+  return (dev * 31 + inum) % NIBUCKET;
+}
+
+// Add ip to the front of bucket h.
+// Caller holds icache.bucket[h].lock.
+static void
+ihashadd(struct inode *ip, int h)
+{
+  ip->hnext = icache.bucket[h].head;
+  icache.bucket[h].head = ip;
+}
+
+// Remove ip from bucket h.
+// Caller holds icache.bucket[h].lock.
+static void
+ihashdel(struct inode *ip, int h)
+{
+  struct inode **pp;
+
+  for(pp = &icache.bucket[h].head; *pp != ip; pp = &(*pp)->hnext)
+    if(*pp == 0)
+      panic("ihashdel");
+  *pp = ip->hnext;
+}
+
+// Look for inode inum on device dev in bucket h.
+// Caller holds icache.bucket[h].lock.
+static struct inode*
+ilookup(int h, uint dev, uint inum)
+{
+  struct inode *ip;
+
+  for(ip = icache.bucket[h].head; ip; ip = ip->hnext){
+    if(ip->dev == dev && ip->inum == inum)
+      return ip;
+  }
+  return 0;
+}
+
+// Put ip, whose ref has just dropped to zero, at the front
+// of the LRU list. Caller holds ip's bucket lock.
+static void
+lruadd(struct inode *ip)
+{
+  acquire(&icache.lrulock);
+  ip->lruprev = 0;
+  ip->lrunext = icache.lruhead;
+  if(icache.lruhead)
+    icache.lruhead->lruprev = ip;
+  else
+    icache.lrutail = ip;
+  icache.lruhead = ip;
+  release(&icache.lrulock);
+}
+
+// Take ip, which is about to get a reference, off the LRU
+// list. Caller holds ip's bucket lock.
+static void
+lrudel(struct inode *ip)
+{
+  acquire(&icache.lrulock);
+  if(ip->lruprev)
+    ip->lruprev->lrunext = ip->lrunext;
+  else
+    icache.lruhead = ip->lrunext;
+  if(ip->lrunext)
+    ip->lrunext->lruprev = ip->lruprev;
+  else
+    icache.lrutail = ip->lruprev;
+  release(&icache.lrulock);
+}
+
 void
 iinit()
 {
-  int i = 0;
+  struct inode *ip;
   
-  initlock(&icache.lock, "icache");
-  for(i = 0; i < NINODE; i++) {
-    initsleeplock(&icache.inode[i].lock, "inode");
+  for(int i = 0; i < NIBUCKET; i++)
+    initlock(&icache.bucket[i].lock, "icache.bucket");
+  initlock(&icache.lrulock, "icache.lru");
+
+  // All entries start out free, as (dev 0, inum 0), which
+  // is never a real inode.
+  for(ip = icache.inode; ip < icache.inode+NINODE; ip++){
+    initsleeplock(&ip->lock, "inode");
+    ihashadd(ip, ihash(ip->dev, ip->inum));
+    lruadd(ip);
+  }
+  dcinit();
+}
+
+// In-memory bitmap of free inodes, built from the inode
+// blocks at boot, so that ialloc() only reads the block of
+// an inode it knows to be free. A bit only changes while
+// holding the buffer of the inode's block, so it agrees with
+// the on-disk type; isum.lock makes the updates atomic for
+// searchers that don't hold the buffer.
+#define NIMAP 4096  // maximum number of inodes
+
+struct {
+  struct spinlock lock;
+  uchar free[NIMAP/8];  // bit set if the inode is free
+  uint cur;             // inode allocated last
+} isum;
+
+// Mark inode inum free or allocated.
+static void
+imark(uint inum, int free)
+{
+  acquire(&isum.lock);
+  if(free)
+    isum.free[inum/8] |= 1 << (inum % 8);
+  else
+    isum.free[inum/8] &= ~(1 << (inum % 8));
+  release(&isum.lock);
+}
+
+// Build the bitmap from the on-disk inodes.
+static void
+isuminit(int dev)
+{
+  struct buf *bp;
+  struct dinode *dip;
+  uint inum;
+
+  initlock(&isum.lock, "isum");
+  if(sb.ninodes > NIMAP)
+    panic("isuminit: too many inodes");
+  bp = 0;
+  for(inum = 1; inum < sb.ninodes; inum++){
+    if(bp == 0 || inum % IPB == 0){
+      if(bp)
+        brelse(bp);
+      bp = bread(dev, IBLOCK(inum, sb));
+    }
+    dip = (struct dinode*)bp->data + inum%IPB;
+    if(dip->type == 0)
+      imark(inum, 1);
+  }
+  if(bp)
+    brelse(bp);
+}
+
+// Find a free inode, the first at or after from, wrapping
+// around. Returns 0 if there is none (inode 0 is never used).
+static uint
+ifind(uint from)
+{
+  uint i, inum, n = sb.ninodes;
+
+  acquire(&isum.lock);
+  for(i = 0; i < n; i++){
+    inum = (from + i) % n;
+    // skip whole bytes of allocated inodes.
+    if(inum % 8 == 0 && isum.free[inum/8] == 0 && inum + 8 <= n){
+      i += 7;
+      continue;
+    }
+    if(inum != 0 && (isum.free[inum/8] & (1 << (inum % 8)))){
+      release(&isum.lock);
+      return inum;
+    }
   }
+  release(&isum.lock);
+  return 0;
 }
 
 static struct inode* iget(uint dev, uint inum);
 
-// Allocate an inode on device dev.
+// Allocate an inode on device dev, preferably near inode
+// near (e.g. the new file's directory), or if near is 0
+// after the last one allocated.
 // Mark it as allocated by  giving it type type.
 // Returns an unlocked but allocated and referenced inode.
 struct inode*
-ialloc(uint dev, short type)
+ialloc(uint dev, short type, uint near)
 {
-  int inum;
+  uint inum;
   struct buf *bp;
   struct dinode *dip;
 
-  for(inum = 1; inum < sb.ninodes; inum++){
+  if(near == 0 || near >= sb.ninodes)
+    near = isum.cur;
+  while((inum = ifind(near)) != 0){
     bp = bread(dev, IBLOCK(inum, sb));
     dip = (struct dinode*)bp->data + inum%IPB;
+    // another CPU may have taken it before we got the buffer.
     if(dip->type == 0){  // a free inode
       memset(dip, 0, sizeof(*dip));
       dip->type = type;
       log_write(bp);   // mark it allocated on the disk
+      imark(inum, 0);
+      isum.cur = inum;
       brelse(bp);
       return iget(dev, inum);
     }
+    imark(inum, 0);
     brelse(bp);
   }
   panic("ialloc: no inodes");
@@ -234,43 +510,87 @@ iupdate(struct inode *ip)
   dip->size = ip->size;
   memmove(dip->addrs, ip->addrs, sizeof(ip->addrs));
   log_write(bp);
+  if(ip->type == 0)  // iput() freed it
+    imark(ip->inum, 1);
   brelse(bp);
 }
 
-// Find the inode with number inum on device dev
-// and return the in-memory copy. Does not lock
-// the inode and does not read it from disk.
+// Inode (dev, inum), which hashes to bucket h, was not
+// cached; recycle the least recently freed entry for it.
 static struct inode*
-iget(uint dev, uint inum)
+irecycle(uint dev, uint inum, int h)
 {
-  struct inode *ip, *empty;
-
-  acquire(&icache.lock);
+  struct inode *ip, *ip0;
+  int vh, lo, hi;
+
+  for(;;){
+    // While ip is on the list its dev and inum can't change,
+    // since recycling takes it off first.
+    acquire(&icache.lrulock);
+    if((ip = icache.lrutail) == 0)
+      panic("iget: no inodes");
+    vh = ihash(ip->dev, ip->inum);
+    release(&icache.lrulock);
+
+    lo = vh < h ? vh : h;
+    hi = vh < h ? h : vh;
+    acquire(&icache.bucket[lo].lock);
+    if(hi != lo)
+      acquire(&icache.bucket[hi].lock);
+
+    // Someone else may have cached the inode while we
+    // held no locks.
+    if((ip0 = ilookup(h, dev, inum)) != 0){
+      if(ip0->ref++ == 0)
+        lrudel(ip0);
+      ip = ip0;
+      break;
+    }
 
-  // Is the inode already cached?
-  empty = 0;
-  for(ip = &icache.inode[0]; ip < &icache.inode[NINODE]; ip++){
-    if(ip->ref > 0 && ip->dev == dev && ip->inum == inum){
-      ip->ref++;
-      release(&icache.lock);
-      return ip;
+    // The victim may have been taken or moved meanwhile.
+    if(ip->ref == 0 && ihash(ip->dev, ip->inum) == vh){
+      lrudel(ip);
+      ihashdel(ip, vh);
+      ip->dev = dev;
+      ip->inum = inum;
+      ip->ref = 1;
+      ip->valid = 0;
+      ihashadd(ip, h);
+      break;
     }
-    if(empty == 0 && ip->ref == 0)    // Remember empty slot.
-      empty = ip;
+
+    if(hi != lo)
+      release(&icache.bucket[hi].lock);
+    release(&icache.bucket[lo].lock);
   }
 
-  // Recycle an inode cache entry.
-  if(empty == 0)
-    panic("iget: no inodes");
+  if(hi != lo)
+    release(&icache.bucket[hi].lock);
+  release(&icache.bucket[lo].lock);
+  return ip;
+}
 
-  ip = empty;
-  ip->dev = dev;
-  ip->inum = inum;
-  ip->ref = 1;
-  ip->valid = 0;
-  release(&icache.lock);
+// Find the inode with number inum on device dev
+// and return the in-memory copy. Does not lock
+// the inode and does not read it from disk.
+static struct inode*
+iget(uint dev, uint inum)
+{
+  struct inode *ip;
+  int h = ihash(dev, inum);
+
+  // Is the inode already cached? A free entry that
+  // still holds it keeps its contents valid.
+  acquire(&icache.bucket[h].lock);
+  if((ip = ilookup(h, dev, inum)) != 0){
+    if(ip->ref++ == 0)
+      lrudel(ip);
+    release(&icache.bucket[h].lock);
+    return ip;
+  }
+  release(&icache.bucket[h].lock);
 
-  return ip;
+  return irecycle(dev, inum, h);
 }
 
 // Increment reference count for ip.
@@ -278,9 +598,11 @@ iget(uint dev, uint inum)
 struct inode*
 idup(struct inode *ip)
 {
-  acquire(&icache.lock);
+  int h = ihash(ip->dev, ip->inum);
+
+  acquire(&icache.bucket[h].lock);
   ip->ref++;
-  release(&icache.lock);
+  release(&icache.bucket[h].lock);
   return ip;
 }
 
@@ -307,6 +629,8 @@ ilock(struct inode *ip)
     ip->size = dip->size;
     memmove(ip->addrs, dip->addrs, sizeof(ip->addrs));
     brelse(bp);
+    ip->runlen = 0;
+    ip->lastalloc = 0;
     ip->valid = 1;
     if(ip->type == 0)
       panic("ilock: no type");
@@ -325,7 +649,7 @@ iunlock(struct inode *ip)
 
 // Drop a reference to an in-memory inode.
 // If that was the last reference, the inode cache entry can
-// be recycled.
+// be recycled, but keeps the inode until it is.
 // If that was the last reference and the inode has no links
 // to it, free the inode (and its content) on disk.
 // All calls to iput() must be inside a transaction in
@@ -333,7 +657,9 @@ iunlock(struct inode *ip)
 void
 iput(struct inode *ip)
 {
-  acquire(&icache.lock);
+  int h = ihash(ip->dev, ip->inum);
+
+  acquire(&icache.bucket[h].lock);
 
   if(ip->ref == 1 && ip->valid && ip->nlink == 0){
     // inode has no links and no other references: truncate and free.
@@ -342,20 +668,23 @@ iput(struct inode *ip)
     // so this acquiresleep() won't block (or deadlock).
     acquiresleep(&ip->lock);
 
-    release(&icache.lock);
+    release(&icache.bucket[h].lock);
 
     itrunc(ip);
+    if(ip->type == T_DIR)
+      dcpurge(ip->dev, ip->inum);
     ip->type = 0;
     iupdate(ip);
     ip->valid = 0;
 
     releasesleep(&ip->lock);
 
-    acquire(&icache.lock);
+    acquire(&icache.bucket[h].lock);
   }
 
-  ip->ref--;
-  release(&icache.lock);
+  if(--ip->ref == 0)
+    lruadd(ip);
+  release(&icache.bucket[h].lock);
 }
 
 // Common idiom: unlock, then put.
@@ -371,40 +700,118 @@ iunlockput(struct inode *ip)
 // The content (data) associated with each inode is stored
 // in blocks on the disk. The first NDIRECT block numbers
 // are listed in ip->addrs[].  The next NINDIRECT blocks are
-// listed in block ip->addrs[NDIRECT].
+// listed in block ip->addrs[NDIRECT]. The next NDINDIRECT
+// blocks are listed in the NINDIRECT blocks that are listed
+// in block ip->addrs[NDIRECT+1].
+//
+// Files written sequentially mostly get consecutive disk
+// blocks, so bmap() remembers the run of contiguous blocks
+// around the last block it found through an indirect block,
+// and maps later blocks of that run without reading the
+// indirect blocks again. Blocks never move once allocated,
+// so the run stays good until itrunc().
+
+// Allocate a block for ip, next to the one allocated last.
+static uint
+bmapalloc(struct inode *ip)
+{
+  ip->lastalloc = balloc(ip->dev, ip->lastalloc ? ip->lastalloc + 1 : 0);
+  return ip->lastalloc;
+}
+
+// Remember the run of consecutive addresses in a[i..n)
+// as the mapping of file blocks starting at bn.
+static void
+bmaprun(struct inode *ip, uint bn, uint *a, uint i, uint n)
+{
+  uint len;
+
+  for(len = 1; i + len < n && a[i + len] == a[i] + len; len++)
+    ;
+  ip->runbn = bn;
+  ip->runaddr = a[i];
+  ip->runlen = len;
+}
+
+// Return entry i of indirect block addr, allocating a block
+// for the entry if it is zero. If the entry was already there
+// and bn >= 0, cache the run of blocks that starts at it.
+static uint
+bmapind(struct inode *ip, uint addr, uint i, int bn)
+{
+  struct buf *bp;
+  uint *a;
+
+  bp = bread(ip->dev, addr);
+  a = (uint*)bp->data;
+  if((addr = a[i]) == 0){
+    a[i] = addr = bmapalloc(ip);
+    log_write(bp);
+  } else if(bn >= 0){
+    bmaprun(ip, bn, a, i, NINDIRECT);
+  }
+  brelse(bp);
+  return addr;
+}
 
 // Return the disk block address of the nth block in inode ip.
 // If there is no such block, bmap allocates one.
 static uint
 bmap(struct inode *ip, uint bn)
 {
-  uint addr, *a;
-  struct buf *bp;
+  uint addr;
 
   if(bn < NDIRECT){
     if((addr = ip->addrs[bn]) == 0)
-      ip->addrs[bn] = addr = balloc(ip->dev);
+      ip->addrs[bn] = addr = bmapalloc(ip);
     return addr;
   }
-  bn -= NDIRECT;
 
-  if(bn < NINDIRECT){
+  if(ip->runlen > 0 && bn - ip->runbn < ip->runlen)
+    return ip->runaddr + (bn - ip->runbn);
+
+  if(bn - NDIRECT < NINDIRECT){
     // Load indirect block, allocating if necessary.
     if((addr = ip->addrs[NDIRECT]) == 0)
-      ip->addrs[NDIRECT] = addr = balloc(ip->dev);
-    bp = bread(ip->dev, addr);
-    a = (uint*)bp->data;
-    if((addr = a[bn]) == 0){
-      a[bn] = addr = balloc(ip->dev);
-      log_write(bp);
-    }
-    brelse(bp);
-    return addr;
+      ip->addrs[NDIRECT] = addr = bmapalloc(ip);
+    return bmapind(ip, addr, bn - NDIRECT, bn);
+  }
+
+  if(bn - NDIRECT - NINDIRECT < NDINDIRECT){
+    uint n = bn - NDIRECT - NINDIRECT;
+    // Load doubly-indirect block, then the indirect block.
+    if((addr = ip->addrs[NDIRECT+1]) == 0)
+      ip->addrs[NDIRECT+1] = addr = bmapalloc(ip);
+    addr = bmapind(ip, addr, n / NINDIRECT, -1);
+    return bmapind(ip, addr, n % NINDIRECT, bn);
   }
 
   panic("bmap: out of range");
 }
 
+// Free the blocks listed in indirect block addr, descending
+// depth more levels of indirect blocks, and then addr itself.
+static void
+itruncind(uint dev, uint addr, int depth)
+{
+  struct buf *bp;
+  uint *a;
+  int j;
+
+  bp = bread(dev, addr);
+  a = (uint*)bp->data;
+  for(j = 0; j < NINDIRECT; j++){
+    if(a[j] == 0)
+      continue;
+    if(depth > 0)
+      itruncind(dev, a[j], depth - 1);
+    else
+      bfree(dev, a[j]);
+  }
+  brelse(bp);
+  bfree(dev, addr);
+}
+
 // Truncate inode (discard contents).
 // Only called when the inode has no links
 // to it (no directory entries referring to it)
@@ -413,9 +820,7 @@ bmap(struct inode *ip, uint bn)
 static void
 itrunc(struct inode *ip)
 {
-  int i, j;
-  struct buf *bp;
-  uint *a;
+  int i;
 
   for(i = 0; i < NDIRECT; i++){
     if(ip->addrs[i]){
@@ -425,17 +830,16 @@ itrunc(struct inode *ip)
   }
 
   if(ip->addrs[NDIRECT]){
-    bp = bread(ip->dev, ip->addrs[NDIRECT]);
-    a = (uint*)bp->data;
-    for(j = 0; j < NINDIRECT; j++){
-      if(a[j])
-        bfree(ip->dev, a[j]);
-    }
-    brelse(bp);
-    bfree(ip->dev, ip->addrs[NDIRECT]);
+    itruncind(ip->dev, ip->addrs[NDIRECT], 0);
     ip->addrs[NDIRECT] = 0;
   }
 
+  if(ip->addrs[NDIRECT+1]){
+    itruncind(ip->dev, ip->addrs[NDIRECT+1], 1);
+    ip->addrs[NDIRECT+1] = 0;
+  }
+
+  ip->runlen = 0;
   ip->size = 0;
   iupdate(ip);
 }
@@ -479,6 +883,36 @@ readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
   return n;
 }
 
+// The caller is about to read n bytes at off and has been
+// reading sequentially: start reading the blocks that cover
+// the request and the NREADAHEAD after it, so that the disk
+// works on them while earlier ones are copied out. At most
+// 2*NREADAHEAD blocks are read ahead, however large n is;
+// any more could be evicted again before readi() got to
+// them, so a large read should come in NREADAHEAD-block
+// pieces, as fileread() does.
+// Caller must hold ip->lock.
+void
+ireadahead(struct inode *ip, uint off, uint n)
+{
+  uint bn, end, last;
+
+  if(off >= ip->size || n == 0)
+    return;
+  if(n > ip->size - off)
+    n = ip->size - off;
+  bn = off / BSIZE;
+  end = (off + n - 1) / BSIZE + 1 + NREADAHEAD;
+  if(end > bn + 2*NREADAHEAD)
+    end = bn + 2*NREADAHEAD;
+  last = (ip->size + BSIZE - 1) / BSIZE;
+  if(end > last)
+    end = last;
+  // every block below size is allocated, so bmap() won't allocate.
+  for(; bn < end; bn++)
+    breadahead(ip->dev, bmap(ip, bn));
+}
+
 // Write data to inode.
 // Caller must hold ip->lock.
 // If user_src==1, then src is a user virtual address;
@@ -525,6 +959,138 @@ namecmp(const char *s, const char *t)
   return strncmp(s, t, DIRSIZ);
 }
 
+// Directory entry cache.
+//
+// Remembers the inum and offset at which a name was found in
+// a directory, keyed by (dev, directory inum, name), so that
+// repeated lookups of the same paths skip the directory scan.
+// Entries are only used and changed with the directory's
+// inode locked, which is also when the directory's contents
+// change: dirlink() adds entries, dcremove() drops them when
+// sys_unlink() clears one, and a freed directory's entries
+// are purged before its inum can be reused.
+//
+// The dcache.lock spin-lock protects the hash chains and the
+// contents of every entry.
+
+#define NDCACHE 64
+#define NDHASH  31
+
+struct dentry {
+  uint dev;
+  uint dinum;           // inum of the directory
+  uint inum;            // 0 if the entry is unused
+  uint off;             // byte offset of the dirent
+  char name[DIRSIZ];
+  struct dentry *next;  // hash chain
+};
+
+struct {
+  struct spinlock lock;
+  struct dentry dentry[NDCACHE];
+  struct dentry *hash[NDHASH];
+  int hand;             // next entry to recycle
+} dcache;
+
+static void
+dcinit(void)
+{
+  initlock(&dcache.lock, "dcache");
+}
+
+static struct dentry**
+dchash(uint dev, uint dinum, char *name)
+{
+  uint h = dev * 31 + dinum;
+
+  for(int i = 0; i < DIRSIZ && name[i]; i++)
+    h = h * 31 + (uchar)name[i];
+  return &dcache.hash[h % NDHASH];
+}
+
+// Find the entry for name in directory (dev, dinum).
+// Caller must hold dcache.lock.
+static struct dentry*
+dcfind(uint dev, uint dinum, char *name)
+{
+  struct dentry *d;
+
+  for(d = *dchash(dev, dinum, name); d; d = d->next){
+    if(d->dev == dev && d->dinum == dinum && namecmp(d->name, name) == 0)
+      return d;
+  }
+  return 0;
+}
+
+// Take entry d off its hash chain and mark it unused.
+// Caller must hold dcache.lock.
+static void
+dcunlink(struct dentry *d)
+{
+  struct dentry **pp;
+
+  for(pp = dchash(d->dev, d->dinum, d->name); *pp; pp = &(*pp)->next){
+    if(*pp == d){
+      *pp = d->next;
+      break;
+    }
+  }
+  d->inum = 0;
+}
+
+// Remember that name is at offset off in dp, with inode inum.
+// Caller must hold dp->lock.
+static void
+dcinsert(struct inode *dp, char *name, uint inum, uint off)
+{
+  struct dentry *d, **pp;
+
+  acquire(&dcache.lock);
+  if((d = dcfind(dp->dev, dp->inum, name)) != 0)
+    dcunlink(d);
+  d = &dcache.dentry[dcache.hand];
+  dcache.hand = (dcache.hand + 1) % NDCACHE;
+  if(d->inum)
+    dcunlink(d);
+  d->dev = dp->dev;
+  d->dinum = dp->inum;
+  d->inum = inum;
+  d->off = off;
+  strncpy(d->name, name, DIRSIZ);
+  pp = dchash(d->dev, d->dinum, d->name);
+  d->next = *pp;
+  *pp = d;
+  release(&dcache.lock);
+}
+
+// Forget name in dp, whose dirent is being cleared.
+// Caller must hold dp->lock.
+void
+dcremove(struct inode *dp, char *name)
+{
+  struct dentry *d;
+
+  acquire(&dcache.lock);
+  if((d = dcfind(dp->dev, dp->inum, name)) != 0)
+    dcunlink(d);
+  release(&dcache.lock);
+}
+
+// Forget every entry of directory (dev, dinum), which is
+// being freed.
+static void
+dcpurge(uint dev, uint dinum)
+{
+  struct dentry *d;
+
+  acquire(&dcache.lock);
+  for(d = dcache.dentry; d < &dcache.dentry[NDCACHE]; d++){
+    if(d->inum && d->dev == dev && d->dinum == dinum)
+      dcunlink(d);
+  }
+  release(&dcache.lock);
+}
+
 // Look for a directory entry in a directory.
 // If found, set *poff to byte offset of entry.
 struct inode*
@@ -532,10 +1098,22 @@ dirlookup(struct inode *dp, char *name, uint *poff)
 {
   uint off, inum;
   struct dirent de;
+  struct dentry *d;
 
   if(dp->type != T_DIR)
     panic("dirlookup not DIR");
 
+  acquire(&dcache.lock);
+  if((d = dcfind(dp->dev, dp->inum, name)) != 0){
+    inum = d->inum;
+    off = d->off;
+    release(&dcache.lock);
+    if(poff)
+      *poff = off;
+    return iget(dp->dev, inum);
+  }
+  release(&dcache.lock);
+
   for(off = 0; off < dp->size; off += sizeof(de)){
     if(readi(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
       panic("dirlookup read");
@@ -546,6 +1124,7 @@ dirlookup(struct inode *dp, char *name, uint *poff)
       if(poff)
         *poff = off;
       inum = de.inum;
+      dcinsert(dp, name, inum, off);
       return iget(dp->dev, inum);
     }
   }
@@ -579,6 +1158,7 @@ dirlink(struct inode *dp, char *name, uint inum)
   de.inum = inum;
   if(writei(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
     panic("dirlink");
+  dcinsert(dp, name, inum, off);
 
   return 0;
 }
@@ -1,6 +1,18 @@
 // Physical memory allocator, for user processes,
 // kernel stacks, page-table pages,
 // and pipe buffers. Allocates whole 4096-byte pages.
+// The first BDSIZE bytes after the kernel are left to the
+// buddy allocator instead.
+//
+// Each CPU keeps its own free list, protected by its own
+// lock, so that kalloc() and kfree() on different CPUs
+// don't contend. A CPU whose list runs dry steals a batch
+// of pages from another CPU's list.
+//
+// Pages can be shared, e.g. by copy-on-write fork, so each
+// page has a reference count. kalloc() returns a page with
+// one reference, kdup() adds one, and kfree() drops one and
+// frees the page when none are left.
 
 #include "types.h"
 #include "param.h"
@@ -9,6 +21,13 @@
 #include "riscv.h"
 #include "defs.h"
 
+// max number of pages moved by one steal.
+#define NSTEAL 64
+
+// bytes just past the kernel given to the buddy allocator,
+// which backs the slab caches for small kernel objects.
+#define BDSIZE (128*1024)
+
 void freerange(void *pa_start, void *pa_end);
 
 extern char end[]; // first address after kernel.
@@ -18,16 +37,23 @@ struct run {
   struct run *next;
 };
 
+// reference counts of physical pages, updated atomically.
+#define PA2REF(pa) (((uint64)(pa) - KERNBASE) / PGSIZE)
+static int refcnt[(PHYSTOP - KERNBASE) / PGSIZE];
+
 struct {
   struct spinlock lock;
   struct run *freelist;
-} kmem;
+} kmem[NCPU];
 
 void
 kinit()
 {
-  initlock(&kmem.lock, "kmem");
-  freerange(end, (void*)PHYSTOP);
+  for(int i = 0; i < NCPU; i++)
+    initlock(&kmem[i].lock, "kmem");
+  char *p = (char*)PGROUNDUP((uint64)end);
+  bd_init(p, p + BDSIZE);
+  freerange(p + BDSIZE, (void*)PHYSTOP);
 }
 
 void
@@ -35,31 +61,71 @@ freerange(void *pa_start, void *pa_end)
 {
   char *p;
   p = (char*)PGROUNDUP((uint64)pa_start);
-  for(; p + PGSIZE <= (char*)pa_end; p += PGSIZE)
+  for(; p + PGSIZE <= (char*)pa_end; p += PGSIZE){
+    refcnt[PA2REF(p)] = 1;
     kfree(p);
+  }
 }
 
-// Free the page of physical memory pointed at by v,
-// which normally should have been returned by a
+// Drop a reference to the page of physical memory pointed
+// at by v, which normally should have been returned by a
 // call to kalloc().  (The exception is when
 // initializing the allocator; see kinit above.)
+// The page is freed when the last reference is dropped.
 void
 kfree(void *pa)
 {
   struct run *r;
+  int id, n;
 
   if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
     panic("kfree");
 
+  n = __sync_sub_and_fetch(&refcnt[PA2REF(pa)], 1);
+  if(n < 0)
+    panic("kfree: refcnt");
+  if(n > 0)
+    return;
+
   // Fill with junk to catch dangling refs.
   memset(pa, 1, PGSIZE);
 
   r = (struct run*)pa;
 
-  acquire(&kmem.lock);
-  r->next = kmem.freelist;
-  kmem.freelist = r;
-  release(&kmem.lock);
+  push_off();
+  id = cpuid();
+  acquire(&kmem[id].lock);
+  r->next = kmem[id].freelist;
+  kmem[id].freelist = r;
+  release(&kmem[id].lock);
+  pop_off();
+}
+
+// Take up to NSTEAL pages from some other CPU's free list
+// and return them as a chain. Holds at most one kmem lock
+// at a time, so stealing CPUs can't deadlock each other.
+static struct run *
+steal(int id)
+{
+  struct run *r, *last;
+  int i, n;
+
+  for(i = 1; i < NCPU; i++){
+    int victim = (id + i) % NCPU;
+    acquire(&kmem[victim].lock);
+    r = kmem[victim].freelist;
+    if(r){
+      last = r;
+      for(n = 1; n < NSTEAL && last->next; n++)
+        last = last->next;
+      kmem[victim].freelist = last->next;
+      last->next = 0;
+      release(&kmem[victim].lock);
+      return r;
+    }
+    release(&kmem[victim].lock);
+  }
+  return 0;
 }
 
 // Allocate one 4096-byte page of physical memory.
@@ -69,14 +135,52 @@ void *
 kalloc(void)
 {
   struct run *r;
+  int id;
 
-  acquire(&kmem.lock);
-  r = kmem.freelist;
-  if(r)
-    kmem.freelist = r->next;
-  release(&kmem.lock);
+  push_off();
+  id = cpuid();
 
+  acquire(&kmem[id].lock);
+  r = kmem[id].freelist;
   if(r)
+    kmem[id].freelist = r->next;
+  release(&kmem[id].lock);
+
+  if(r == 0 && (r = steal(id)) != 0){
+    // keep the first page, put the rest of the batch
+    // on this CPU's list.
+    acquire(&kmem[id].lock);
+    if(r->next){
+      struct run *last = r->next;
+      while(last->next)
+        last = last->next;
+      last->next = kmem[id].freelist;
+      kmem[id].freelist = r->next;
+    }
+    release(&kmem[id].lock);
+  }
+  pop_off();
+
+  if(r){
     memset((char*)r, 5, PGSIZE); // fill with junk
+    refcnt[PA2REF(r)] = 1;
+  }
   return (void*)r;
 }
+
+// Add a reference to the allocated page pa.
+void
+kdup(void *pa)
+{
+  if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
+    panic("kdup");
+  if(__sync_fetch_and_add(&refcnt[PA2REF(pa)], 1) < 1)
+    panic("kdup: free page");
+}
+
+// Return the number of references to page pa.
+int
+krefs(void *pa)
+{
+  return refcnt[PA2REF(pa)];
+}
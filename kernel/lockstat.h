@@ -0,0 +1,18 @@
+// Lock statistics, read from the lock statistics device
+// (major number LOCKSTAT) as an array of these records, one
+// per lock in the order the locks were initialized.
+// Writing anything to the device clears the statistics.
+// Times are in cycles.
+
+#define LOCKSTAT 2
+
+struct lockstat {
+  char name[16];      // lock name, truncated
+  uint n;             // acquire() calls
+  uint nts;           // test-and-set spins while acquiring
+  uint64 hold;        // total time held
+  uint64 maxhold;     // longest time held
+  uint ncpu[NCPU];    // acquisitions by each CPU
+  uint nsleep;        // sleep-lock acquisitions that had to wait
+  uint64 sleepwait;   // total time waiting for the sleep-lock
+};
@@ -19,7 +19,30 @@
 // its start and end. Usually begin_op() just increments
 // the count of in-progress FS system calls and returns.
 // But if it thinks the log is close to running out, it
-// sleeps until the last outstanding end_op() commits.
+// sleeps until the flusher has committed.
+//
+// Commits are done by a per-log kernel thread, the flusher,
+// not by end_op(). The flusher commits whenever no FS system
+// calls are active, so the updates of all system calls that
+// ended since the last commit go to disk as one group, and
+// end_op() returns without waiting for the disk. So, unlike
+// a plain commit in end_op(), returning from a system call no
+// longer means its updates survive a crash; they are only
+// certain to be on disk once log_sync() returns, which the
+// fsync() and sync() system calls call.
+//
+// Committed blocks are not written to their home locations
+// right away. They stay pinned in the buffer cache, and the
+// log header keeps listing them, so the log serves as the list
+// of dirty blocks. Only when the log is getting full does the
+// flusher install them all, sorted by block number so that
+// adjacent blocks go to the disk together, and then clear the
+// log. A block changed in many transactions, such as a bitmap
+// or inode block, is then written home once rather than once
+// per commit. A committed block that is changed again gets a
+// new log slot, since its old slot belongs to a committed
+// header; recovery installs the slots in order, so the last
+// copy wins.
 //
 // The log is a physical re-do log containing disk blocks.
 // The on-disk log format:
@@ -43,13 +66,20 @@ struct log {
   int size;
   int outstanding; // how many FS sys calls are executing.
   int committing;  // in commit(), please wait.
+  int ncommitted;  // lh.block[0..ncommitted) are already committed.
+  uint ncommit;    // number of commits completed, for log_sync().
   int dev;
   struct logheader lh;
 };
 struct log log[NDISK];
 
+// number of blocks write_log() and install_trans()
+// hand to the disk in one bwritev().
+#define LOGBATCH 10
+
 static void recover_from_log(int);
 static void commit(int);
+static void flusher(int);
 
 void
 initlog(int dev, struct superblock *sb)
@@ -62,22 +92,63 @@ initlog(int dev, struct superblock *sb)
   log[dev].size = sb->nlog;
   log[dev].dev = dev;
   recover_from_log(dev);
+  if(kthread(flusher, dev, "logflush") < 0)
+    panic("initlog: flusher");
 }
 
-// Copy committed blocks from log to their home location
+// Copy committed blocks to their home locations, in block
+// order. A block in the log more than once is written once,
+// from its last slot. After a crash the log is the only copy
+// of the blocks; otherwise the pinned cache blocks already
+// hold the committed data and only need to be written.
 static void
-install_trans(int dev)
+install_trans(int dev, int recovering)
 {
-  int tail;
-
-  for (tail = 0; tail < log[dev].lh.n; tail++) {
-    struct buf *lbuf = bread(dev, log[dev].start+tail+1); // read log block
-    struct buf *dbuf = bread(dev, log[dev].lh.block[tail]); // read dst
-    memmove(dbuf->data, lbuf->data, BSIZE);  // copy block to dst
-    bwrite(dbuf);  // write dst to disk
-    bunpin(dbuf);
-    brelse(lbuf);
-    brelse(dbuf);
+  struct logheader *lh = &log[dev].lh;
+  struct buf *lbuf, *dbuf[LOGBATCH];
+  int order[LOGSIZE];
+  int n, tail, i, j, k;
+
+  // the last slot of each block, sorted by block number.
+  n = 0;
+  for (i = 0; i < lh->n; i++) {
+    for (j = i + 1; j < lh->n; j++) {
+      if (lh->block[j] == lh->block[i])
+        break;
+    }
+    if (j < lh->n)
+      continue;
+    for (j = n; j > 0 && lh->block[order[j-1]] > lh->block[i]; j--)
+      order[j] = order[j-1];
+    order[j] = i;
+    n++;
+  }
+
+  for (tail = 0; tail < n; tail += k) {
+    k = n - tail;
+    if(k > LOGBATCH)
+      k = LOGBATCH;
+    for (i = 0; i < k; i++) {
+      j = order[tail+i];
+      dbuf[i] = bread(dev, lh->block[j]); // read dst
+      if(recovering){
+        lbuf = bread(dev, log[dev].start+j+1); // read log block
+        memmove(dbuf[i]->data, lbuf->data, BSIZE);  // copy block to dst
+        brelse(lbuf);
+      }
+    }
+    bwritev(dbuf, k);  // write dsts to disk
+    for (i = 0; i < k; i++)
+      brelse(dbuf[i]);
+  }
+
+  if(!recovering){
+    // drop the pin log_write() took for each slot.
+    for (i = 0; i < lh->n; i++) {
+      dbuf[0] = bread(dev, lh->block[i]);
+      bunpin(dbuf[0]);
+      brelse(dbuf[0]);
+    }
   }
 }
 
@@ -116,7 +187,7 @@ static void
 recover_from_log(int dev)
 {
   read_head(dev);
-  install_trans(dev); // if committed, copy from log to disk
+  install_trans(dev, 1); // if committed, copy from log to disk
   log[dev].lh.n = 0;
   write_head(dev); // clear the log
 }
@@ -141,19 +212,18 @@ begin_op(int dev)
 }
 
 // called at the end of each FS system call.
-// commits if this was the last outstanding operation.
+// lets the flusher commit if this was the last outstanding
+// operation; doesn't wait for the commit.
 void
 end_op(int dev)
 {
-  int do_commit = 0;
-
   acquire(&log[dev].lock);
   log[dev].outstanding -= 1;
   if(log[dev].committing)
     panic("log[dev].committing");
   if(log[dev].outstanding == 0){
-    do_commit = 1;
-    log[dev].committing = 1;
+    if(log[dev].lh.n > log[dev].ncommitted)
+      wakeup(&log[dev].lh);
   } else {
     // begin_op() may be waiting for log space,
     // and decrementing log[dev].outstanding has decreased
@@ -161,43 +231,90 @@ end_op(int dev)
     wakeup(&log);
   }
   release(&log[dev].lock);
+}
+
+// Wait until the updates of every FS system call that has
+// already called end_op() are committed to disk.
+void
+log_sync(int dev)
+{
+  uint target;
+
+  acquire(&log[dev].lock);
+  // ops can't end while a commit is in progress, so an ended
+  // op is either in the running commit or in the next one.
+  if(log[dev].committing || log[dev].lh.n > log[dev].ncommitted){
+    target = log[dev].ncommit + 1;
+    while((int)(log[dev].ncommit - target) < 0)
+      sleep(&log, &log[dev].lock);
+  }
+  release(&log[dev].lock);
+}
+
+// The flusher kernel thread: commit the current group of
+// operations whenever none of them is still executing.
+static void
+flusher(int dev)
+{
+  acquire(&log[dev].lock);
+  for(;;){
+    if(log[dev].outstanding > 0 || log[dev].lh.n == log[dev].ncommitted){
+      sleep(&log[dev].lh, &log[dev].lock);
+      continue;
+    }
+    log[dev].committing = 1;
+    release(&log[dev].lock);
 
-  if(do_commit){
     // call commit w/o holding locks, since not allowed
     // to sleep with locks.
     commit(dev);
+
     acquire(&log[dev].lock);
     log[dev].committing = 0;
+    log[dev].ncommit++;
     wakeup(&log);
-    release(&log[dev].lock);
   }
 }
 
-// Copy modified blocks from cache to log.
+// Copy the blocks modified since the last commit
+// from cache to log.
 static void
 write_log(int dev)
 {
-  int tail;
-
-  for (tail = 0; tail < log[dev].lh.n; tail++) {
-    struct buf *to = bread(dev, log[dev].start+tail+1); // log block
-    struct buf *from = bread(dev, log[dev].lh.block[tail]); // cache block
-    memmove(to->data, from->data, BSIZE);
-    bwrite(to);  // write the log
-    brelse(from);
-    brelse(to);
+  struct buf *to[LOGBATCH];
+  int tail, i, k;
+
+  for (tail = log[dev].ncommitted; tail < log[dev].lh.n; tail += k) {
+    k = log[dev].lh.n - tail;
+    if(k > LOGBATCH)
+      k = LOGBATCH;
+    for (i = 0; i < k; i++) {
+      to[i] = bread(dev, log[dev].start+tail+i+1); // log block
+      struct buf *from = bread(dev, log[dev].lh.block[tail+i]); // cache block
+      memmove(to[i]->data, from->data, BSIZE);
+      brelse(from);
+    }
+    bwritev(to, k);  // write the log
+    for (i = 0; i < k; i++)
+      brelse(to[i]);
   }
 }
 
 static void
 commit(int dev)
 {
-  if (log[dev].lh.n > 0) {
+  if (log[dev].lh.n > log[dev].ncommitted) {
     write_log(dev);     // Write modified blocks from cache to log
     write_head(dev);    // Write header to disk -- the real commit
-    install_trans(dev); // Now install writes to home locations
+    log[dev].ncommitted = log[dev].lh.n;
+  }
+  // install once fewer than three ops' worth of log space is
+  // left, so begin_op() can always make progress.
+  if (log[dev].lh.n > LOGSIZE - 3*MAXOPBLOCKS) {
+    install_trans(dev, 0); // Now install writes to home locations
     log[dev].lh.n = 0;
-    write_head(dev);    // Erase the transaction from the log
+    log[dev].ncommitted = 0;
+    write_head(dev);    // Erase the transactions from the log
   }
 }
 
@@ -222,7 +339,8 @@ log_write(struct buf *b)
     panic("log_write outside of trans");
 
   acquire(&log[dev].lock);
-  for (i = 0; i < log[dev].lh.n; i++) {
+  // committed slots can't change; absorb only into this group.
+  for (i = log[dev].ncommitted; i < log[dev].lh.n; i++) {
     if (log[dev].lh.block[i] == b->blockno)   // log absorbtion
       break;
   }
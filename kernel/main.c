@@ -31,6 +31,8 @@ main()
     binit();         // buffer cache
     iinit();         // inode cache
     fileinit();      // file table
+    pipeinit();      // pipe cache
+    lockstatinit();  // lock statistics device
     virtio_disk_init(minor(ROOTDEV)); // emulated hard disk
     userinit();      // first user process
     __sync_synchronize();
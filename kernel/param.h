@@ -1,14 +1,16 @@
 #define NPROC        10  // maximum number of processes
 #define NCPU          8  // maximum number of CPUs
 #define NOFILE       16  // open files per process
-#define NFILE       100  // open files per system
+#define NFILE       100  // old limit on open files; no longer enforced
 #define NINODE       50  // maximum number of active i-nodes
 #define NDEV         10  // maximum major device number
 #define ROOTDEV       0  // device number of file system root disk
 #define MAXARG       32  // max exec arguments
 #define MAXOPBLOCKS  10  // max # of blocks any FS op writes
-#define LOGSIZE      (MAXOPBLOCKS*3)  // max data blocks in on-disk log
-#define NBUF         (MAXOPBLOCKS*3)  // size of disk block cache
-#define FSSIZE       2000  // size of file system in blocks
+#define LOGSIZE      (MAXOPBLOCKS*6)  // max data blocks in on-disk log
+#define NBUF         (MAXOPBLOCKS*10)  // size of disk block cache
+#define NREADAHEAD   8  // blocks to read ahead of a sequential reader
+#define FSSIZE       200000  // size of file system in blocks
 #define MAXPATH      128   // maximum file path name
 #define NDISK        2
+#define NVMA         16  // mmap()ed regions per process
@@ -7,18 +7,44 @@
 #include "fs.h"
 #include "sleeplock.h"
 #include "file.h"
+#include "slab.h"
 
-#define PIPESIZE 512
+// A pipe's buffer is a page of its own, so a large write
+// moves a page per wakeup instead of 512 bytes. Data is
+// copied in contiguous chunks rather than byte by byte.
+//
+// A writer with at least a page left to write, starting on a
+// page boundary, lends that page to the pipe instead of
+// copying it into the buffer: readers copy straight out of
+// the writer's memory, and the writer sleeps until they have
+// taken all of it. This saves a copy per byte for big
+// transfers. A loan is only made when the buffer is empty,
+// and no one else writes into the buffer until it is repaid,
+// so bytes still come out in order.
+#define PIPESIZE PGSIZE
 
 struct pipe {
   struct spinlock lock;
-  char data[PIPESIZE];
+  char *data;     // PIPESIZE bytes
   uint nread;     // number of bytes read
   uint nwrite;    // number of bytes written
   int readopen;   // read fd is still open
   int writeopen;  // write fd is still open
+  uint64 loan;    // physical address of lent bytes, or 0
+  uint loanoff;   // bytes of the loan read so far
+  uint loanlen;   // size of the loan
 };
 
+// struct pipe is far smaller than a page, so it comes from a
+// slab cache rather than kalloc().
+static struct slabcache pipecache;
+
+void
+pipeinit(void)
+{
+  slabinit(&pipecache, "pipe", sizeof(struct pipe));
+}
+
 int
 pipealloc(struct file **f0, struct file **f1)
 {
@@ -28,12 +54,15 @@ pipealloc(struct file **f0, struct file **f1)
   *f0 = *f1 = 0;
   if((*f0 = filealloc()) == 0 || (*f1 = filealloc()) == 0)
     goto bad;
-  if((pi = (struct pipe*)kalloc()) == 0)
+  if((pi = slaballoc(&pipecache)) == 0)
+    goto bad;
+  if((pi->data = kalloc()) == 0)
     goto bad;
   pi->readopen = 1;
   pi->writeopen = 1;
   pi->nwrite = 0;
   pi->nread = 0;
+  pi->loan = 0;
   memset(&pi->lock, 0, sizeof(pi->lock));
   (*f0)->type = FD_PIPE;
   (*f0)->readable = 1;
@@ -47,7 +76,7 @@ pipealloc(struct file **f0, struct file **f1)
 
  bad:
   if(pi)
-    kfree((char*)pi);
+    slabfree(&pipecache, pi);
   if(*f0)
     fileclose(*f0);
   if(*f1)
@@ -68,21 +97,55 @@ pipeclose(struct pipe *pi, int writable)
   }
   if(pi->readopen == 0 && pi->writeopen == 0){
     release(&pi->lock);
-    kfree((char*)pi);
+    kfree(pi->data);
+    slabfree(&pipecache, pi);
   } else
     release(&pi->lock);
 }
 
+// Lend the page at user address va to the readers of pi and
+// wait for them to read it. Returns how many of its bytes they
+// took: PGSIZE once they have all of it, fewer if the read end
+// closed or we were killed first, or -1 if va isn't mapped.
+// Caller holds pi->lock, and the buffer is empty.
+static int
+pipelend(struct pipe *pi, uint64 va)
+{
+  struct proc *pr = myproc();
+  uint64 pa;
+
+  pa = walkaddr(pr->pagetable, va);
+  if(pa == 0 && uvmlazy(pr->pagetable, va) == 0)
+    pa = walkaddr(pr->pagetable, va);
+  if(pa == 0)
+    return -1;
+
+  pi->loan = pa;
+  pi->loanoff = 0;
+  pi->loanlen = PGSIZE;
+  wakeup(&pi->nread);
+  while(pi->loanoff < pi->loanlen){
+    if(pi->readopen == 0 || pr->killed){
+      pi->loan = 0;
+      return pi->loanoff;
+    }
+    sleep(&pi->nwrite, &pi->lock);
+  }
+  pi->loan = 0;
+  // other writers may be waiting for the loan to end.
+  wakeup(&pi->nwrite);
+  return PGSIZE;
+}
+
 int
 pipewrite(struct pipe *pi, uint64 addr, int n)
 {
-  int i;
-  char ch;
+  int i, m;
   struct proc *pr = myproc();
 
   acquire(&pi->lock);
-  for(i = 0; i < n; i++){
-    while(pi->nwrite == pi->nread + PIPESIZE){  //DOC: pipewrite-full
+  for(i = 0; i < n; i += m){
+    while(pi->nwrite == pi->nread + PIPESIZE || pi->loan){  //DOC: pipewrite-full
       if(pi->readopen == 0 || myproc()->killed){
         release(&pi->lock);
         return -1;
@@ -90,36 +153,73 @@ pipewrite(struct pipe *pi, uint64 addr, int n)
       wakeup(&pi->nread);
       sleep(&pi->nwrite, &pi->lock);
     }
-    if(copyin(pr->pagetable, &ch, addr + i, 1) == -1)
+    if(pi->nwrite == pi->nread && n - i >= PGSIZE && (addr + i) % PGSIZE == 0){
+      if((m = pipelend(pi, addr + i)) < PGSIZE){
+        // count what the readers took before it failed, and
+        // report a partial write if anything got through.
+        if(m > 0)
+          i += m;
+        if(i == 0){
+          release(&pi->lock);
+          return -1;
+        }
+        break;
+      }
+      continue;
+    }
+    // as much as fits before the end of the ring.
+    m = n - i;
+    if(m > pi->nread + PIPESIZE - pi->nwrite)
+      m = pi->nread + PIPESIZE - pi->nwrite;
+    if(m > PIPESIZE - pi->nwrite % PIPESIZE)
+      m = PIPESIZE - pi->nwrite % PIPESIZE;
+    if(copyin(pr->pagetable, &pi->data[pi->nwrite % PIPESIZE], addr + i, m) == -1)
       break;
-    pi->data[pi->nwrite++ % PIPESIZE] = ch;
+    pi->nwrite += m;
   }
   wakeup(&pi->nread);
   release(&pi->lock);
-  return n;
+  return i;
 }
 
 int
 piperead(struct pipe *pi, uint64 addr, int n)
 {
-  int i;
+  int i, m;
   struct proc *pr = myproc();
-  char ch;
 
   acquire(&pi->lock);
-  while(pi->nread == pi->nwrite && pi->writeopen){  //DOC: pipe-empty
+  while(pi->nread == pi->nwrite && pi->loan == 0 && pi->writeopen){  //DOC: pipe-empty
     if(myproc()->killed){
       release(&pi->lock);
       return -1;
     }
     sleep(&pi->nread, &pi->lock); //DOC: piperead-sleep
   }
-  for(i = 0; i < n; i++){  //DOC: piperead-copy
+  if(pi->loan){
+    // the buffer is empty; read from the writer's page.
+    m = n;
+    if(m > pi->loanlen - pi->loanoff)
+      m = pi->loanlen - pi->loanoff;
+    if(copyout(pr->pagetable, addr, (char*)pi->loan + pi->loanoff, m) == -1)
+      m = 0;
+    pi->loanoff += m;
+    wakeup(&pi->nwrite);
+    release(&pi->lock);
+    return m;
+  }
+  for(i = 0; i < n; i += m){  //DOC: piperead-copy
     if(pi->nread == pi->nwrite)
       break;
-    ch = pi->data[pi->nread++ % PIPESIZE];
-    if(copyout(pr->pagetable, addr + i, &ch, 1) == -1)
+    // as much as is there before the end of the ring.
+    m = n - i;
+    if(m > pi->nwrite - pi->nread)
+      m = pi->nwrite - pi->nread;
+    if(m > PIPESIZE - pi->nread % PIPESIZE)
+      m = PIPESIZE - pi->nread % PIPESIZE;
+    if(copyout(pr->pagetable, addr + i, &pi->data[pi->nread % PIPESIZE], m) == -1)
       break;
+    pi->nread += m;
   }
   wakeup(&pi->nwrite);  //DOC: piperead-wakeup
   release(&pi->lock);
@@ -15,11 +15,58 @@ struct proc proc[NPROC];
 
 struct proc *initproc;
 
+// Per-CPU queues of RUNNABLE processes, linked through
+// p->rqnext. A process is on a queue exactly from when it
+// becomes RUNNABLE until a scheduler takes it off to run it.
+// Lock order: p->lock, then a runq lock.
+struct runq {
+  struct spinlock lock;
+  struct proc *head;
+  struct proc *tail;
+} runq[NCPU];
+
+// Wait queues for sleep()/wakeup(), hashed by channel, so that
+// wakeup() only looks at processes that may be sleeping on chan.
+// A sleeper links itself in before it sleeps and unlinks itself
+// after it wakes; wakeup() only changes state.
+// Lock order: sleepq lock, then p->lock.
+#define NSLEEPQ 31
+struct sleepq {
+  struct spinlock lock;
+  struct proc *head;
+} sleepq[NSLEEPQ];
+
+static struct sleepq*
+sqhash(void *chan)
+{
+  return &sleepq[((uint64)chan >> 4) % NSLEEPQ];
+}
+
+// UNUSED procs, linked through p->nextfree, so allocproc()
+// needn't search the table.
+// Lock order: p->lock, then procfree.lock.
+struct {
+  struct spinlock lock;
+  struct proc *head;
+} procfree;
+
+// Live procs hashed by pid, linked through p->pidnext, so
+// kill() needn't search the table. A proc is on its chain
+// from allocproc() until freeproc().
+// Lock order: p->lock, then a pidhash lock.
+#define NPIDHASH 31
+struct pidhash {
+  struct spinlock lock;
+  struct proc *head;
+} pidhash[NPIDHASH];
+
 int nextpid = 1;
 struct spinlock pid_lock;
 
 extern void forkret(void);
+static void kthreadret(void);
 static void wakeup1(struct proc *chan);
+static void freeproc(struct proc *p);
 
 extern char trampoline[]; // trampoline.S
 
@@ -29,8 +76,17 @@ procinit(void)
   struct proc *p;
   
   initlock(&pid_lock, "nextpid");
+  for(int i = 0; i < NCPU; i++)
+    initlock(&runq[i].lock, "runq");
+  for(int i = 0; i < NSLEEPQ; i++)
+    initlock(&sleepq[i].lock, "sleepq");
+  initlock(&procfree.lock, "procfree");
+  for(int i = 0; i < NPIDHASH; i++)
+    initlock(&pidhash[i].lock, "pidhash");
   for(p = proc; p < &proc[NPROC]; p++) {
       initlock(&p->lock, "proc");
+      p->nextfree = procfree.head;
+      procfree.head = p;
 
       // Allocate a page for the process's kernel stack.
       // Map it high in memory, followed by an invalid
@@ -74,6 +130,61 @@ myproc(void) {
   return p;
 }
 
+// Mark p RUNNABLE and append it to this CPU's run queue.
+// Caller must hold p->lock, so interrupts are off.
+static void
+runqadd(struct proc *p)
+{
+  struct runq *q = &runq[cpuid()];
+
+  if(!holding(&p->lock))
+    panic("runqadd");
+  p->state = RUNNABLE;
+  p->rqnext = 0;
+  acquire(&q->lock);
+  if(q->tail)
+    q->tail->rqnext = p;
+  else
+    q->head = p;
+  q->tail = p;
+  release(&q->lock);
+}
+
+// Take the first process off CPU id's run queue, or return 0.
+static struct proc*
+runqget(int id)
+{
+  struct runq *q = &runq[id];
+  struct proc *p;
+
+  acquire(&q->lock);
+  if((p = q->head) != 0){
+    q->head = p->rqnext;
+    if(q->head == 0)
+      q->tail = 0;
+    p->rqnext = 0;
+  }
+  release(&q->lock);
+  return p;
+}
+
+// This CPU has nothing to run; take work from another CPU.
+static struct proc*
+runqsteal(int id)
+{
+  struct proc *p;
+
+  for(int i = 1; i < NCPU; i++){
+    int j = (id + i) % NCPU;
+    // racy peek, to avoid locking idle queues.
+    if(runq[j].head == 0)
+      continue;
+    if((p = runqget(j)) != 0)
+      return p;
+  }
+  return 0;
+}
+
 int
 allocpid() {
   int pid;
@@ -86,8 +197,35 @@ allocpid() {
   return pid;
 }
 
-// Look in the process table for an UNUSED proc.
-// If found, initialize state required to run in the kernel,
+// Add p to the pid hash. Caller must hold p->lock.
+static void
+pidadd(struct proc *p)
+{
+  struct pidhash *h = &pidhash[p->pid % NPIDHASH];
+
+  acquire(&h->lock);
+  p->pidnext = h->head;
+  h->head = p;
+  release(&h->lock);
+}
+
+// Remove p from the pid hash. Caller must hold p->lock.
+static void
+piddel(struct proc *p)
+{
+  struct pidhash *h = &pidhash[p->pid % NPIDHASH];
+  struct proc **pp;
+
+  acquire(&h->lock);
+  for(pp = &h->head; *pp != p; pp = &(*pp)->pidnext)
+    if(*pp == 0)
+      panic("piddel");
+  *pp = p->pidnext;
+  release(&h->lock);
+}
+
+// Take an UNUSED proc off the free list.
+// If there is one, initialize state required to run in the kernel,
 // and return with p->lock held.
 // If there are no free procs, return 0.
 static struct proc*
@@ -95,21 +233,22 @@ allocproc(void)
 {
   struct proc *p;
 
-  for(p = proc; p < &proc[NPROC]; p++) {
-    acquire(&p->lock);
-    if(p->state == UNUSED) {
-      goto found;
-    } else {
-      release(&p->lock);
-    }
-  }
-  return 0;
+  acquire(&procfree.lock);
+  if((p = procfree.head) != 0)
+    procfree.head = p->nextfree;
+  release(&procfree.lock);
+  if(p == 0)
+    return 0;
 
-found:
+  acquire(&p->lock);
+  if(p->state != UNUSED)
+    panic("allocproc");
   p->pid = allocpid();
+  pidadd(p);
 
   // Allocate a trapframe page.
   if((p->tf = (struct trapframe *)kalloc()) == 0){
+    freeproc(p);
     release(&p->lock);
     return 0;
   }
@@ -127,7 +266,7 @@ found:
 }
 
 // free a proc structure and the data hanging from it,
-// including user pages.
+// including user pages, and put it back on the free list.
 // p->lock must be held.
 static void
 freeproc(struct proc *p)
@@ -139,13 +278,22 @@ freeproc(struct proc *p)
     proc_freepagetable(p->pagetable, p->sz);
   p->pagetable = 0;
   p->sz = 0;
-  p->pid = 0;
   p->parent = 0;
   p->name[0] = 0;
   p->chan = 0;
   p->killed = 0;
   p->xstate = 0;
+  p->kfn = 0;
+  p->children = 0;
+  p->sibling = 0;
+  piddel(p);
+  p->pid = 0;
   p->state = UNUSED;
+
+  acquire(&procfree.lock);
+  p->nextfree = procfree.head;
+  procfree.head = p;
+  release(&procfree.lock);
 }
 
 // Create a page table for a given process,
@@ -216,7 +364,7 @@ userinit(void)
   safestrcpy(p->name, "initcode", sizeof(p->name));
   p->cwd = namei("/");
 
-  p->state = RUNNABLE;
+  runqadd(p);
 
   release(&p->lock);
 }
@@ -226,7 +374,7 @@ userinit(void)
 int
 growproc(int n)
 {
-  uint sz;
+  uint64 sz;
   struct proc *p = myproc();
 
   sz = p->sz;
@@ -263,6 +411,13 @@ fork(void)
   }
   np->sz = p->sz;
 
+  // Share the pages of mmap()ed files too.
+  if(mmapdup(p, np) < 0){
+    freeproc(np);
+    release(&np->lock);
+    return -1;
+  }
+
   np->parent = p;
 
   // copy saved user registers.
@@ -281,37 +436,63 @@ fork(void)
 
   pid = np->pid;
 
-  np->state = RUNNABLE;
+  // No one else can reach np yet, so taking its parent's
+  // lock after its own can't deadlock.
+  acquire(&p->lock);
+  np->sibling = p->children;
+  p->children = np;
+  release(&p->lock);
+
+  runqadd(np);
 
   release(&np->lock);
 
   return pid;
 }
 
-// Pass p's abandoned children to init.
-// Caller must hold p->lock.
+// Create a kernel thread that runs fn(arg) in the kernel.
+// It has no user memory, no parent, and must never return.
+// Returns its pid, or -1 if there are no free procs.
+int
+kthread(void (*fn)(int), int arg, char *name)
+{
+  int pid;
+  struct proc *np;
+
+  if((np = allocproc()) == 0)
+    return -1;
+
+  np->kfn = fn;
+  np->karg = arg;
+  np->context.ra = (uint64)kthreadret;
+  safestrcpy(np->name, name, sizeof(np->name));
+
+  pid = np->pid;
+  runqadd(np);
+  release(&np->lock);
+
+  return pid;
+}
+
+// Pass p's abandoned children to init, and wake init
+// in case one of them is a zombie.
+// Caller must hold p->lock and initproc->lock.
 void
 reparent(struct proc *p)
 {
   struct proc *pp;
 
-  for(pp = proc; pp < &proc[NPROC]; pp++){
-    // this code uses pp->parent without holding pp->lock.
-    // acquiring the lock first could cause a deadlock
-    // if pp or a child of pp were also in exit()
-    // and about to try to lock p.
-    if(pp->parent == p){
-      // pp->parent can't change between the check and the acquire()
-      // because only the parent changes it, and we're the parent.
-      acquire(&pp->lock);
-      pp->parent = initproc;
-      // we should wake up init here, but that would require
-      // initproc->lock, which would be a deadlock, since we hold
-      // the lock on one of init's children (pp). this is why
-      // exit() always wakes init (before acquiring any locks).
-      release(&pp->lock);
-    }
+  if(p->children == 0)
+    return;
+  while((pp = p->children) != 0){
+    p->children = pp->sibling;
+    acquire(&pp->lock);
+    pp->parent = initproc;
+    release(&pp->lock);
+    pp->sibling = initproc->children;
+    initproc->children = pp;
   }
+  wakeup1(initproc);
 }
 
 // Exit the current process.  Does not return.
@@ -325,6 +506,9 @@ exit(int status)
   if(p == initproc)
     panic("init exiting");
 
+  // Write back and drop mmap()ed regions.
+  munmapall(p);
+
   // Close all open files.
   for(int fd = 0; fd < NOFILE; fd++){
     if(p->ofile[fd]){
@@ -339,28 +523,18 @@ exit(int status)
   end_op(ROOTDEV);
   p->cwd = 0;
 
-  // we might re-parent a child to init. we can't be precise about
-  // waking up init, since we can't acquire its lock once we've
-  // acquired any other proc lock. so wake up init whether that's
-  // necessary or not. init may miss this wakeup, but that seems
-  // harmless.
+  // we might re-parent a child to init, which needs init's lock.
+  // init is everyone's ancestor, so locking it first keeps to
+  // the parent-then-child rule. it also stops our parent from
+  // exiting and giving us away to init meanwhile, since that
+  // takes the same lock, so p->parent is stable from here on.
   acquire(&initproc->lock);
-  wakeup1(initproc);
-  release(&initproc->lock);
+  struct proc *parent = p->parent;
 
-  // grab a copy of p->parent, to ensure that we unlock the same
-  // parent we locked. in case our parent gives us away to init while
-  // we're waiting for the parent lock. we may then race with an
-  // exiting parent, but the result will be a harmless spurious wakeup
-  // to a dead or wrong process; proc structs are never re-allocated
-  // as anything else.
-  acquire(&p->lock);
-  struct proc *original_parent = p->parent;
-  release(&p->lock);
-  
   // we need the parent's lock in order to wake it up from wait().
   // the parent-then-child rule says we have to lock it first.
-  acquire(&original_parent->lock);
+  if(parent != initproc)
+    acquire(&parent->lock);
 
   acquire(&p->lock);
 
@@ -368,12 +542,14 @@ exit(int status)
   reparent(p);
 
   // Parent might be sleeping in wait().
-  wakeup1(original_parent);
+  wakeup1(parent);
 
   p->xstate = status;
   p->state = ZOMBIE;
 
-  release(&original_parent->lock);
+  if(parent != initproc)
+    release(&parent->lock);
+  release(&initproc->lock);
 
   // Jump into the scheduler, never to return.
   sched();
@@ -385,46 +561,39 @@ exit(int status)
 int
 wait(uint64 addr)
 {
-  struct proc *np;
-  int havekids, pid;
+  struct proc *np, **pp;
+  int pid;
   struct proc *p = myproc();
 
   // hold p->lock for the whole time to avoid lost
-  // wakeups from a child's exit().
+  // wakeups from a child's exit(). it also protects
+  // our list of children.
   acquire(&p->lock);
 
   for(;;){
-    // Scan through table looking for exited children.
-    havekids = 0;
-    for(np = proc; np < &proc[NPROC]; np++){
-      // this code uses np->parent without holding np->lock.
-      // acquiring the lock first would cause a deadlock,
-      // since np might be an ancestor, and we already hold p->lock.
-      if(np->parent == p){
-        // np->parent can't change between the check and the acquire()
-        // because only the parent changes it, and we're the parent.
-        acquire(&np->lock);
-        havekids = 1;
-        if(np->state == ZOMBIE){
-          // Found one.
-          pid = np->pid;
-          if(addr != 0 && copyout(p->pagetable, addr, (char *)&np->xstate,
-                                  sizeof(np->xstate)) < 0) {
-            release(&np->lock);
-            release(&p->lock);
-            return -1;
-          }
-          freeproc(np);
+    // Scan through our children looking for exited ones.
+    for(pp = &p->children; (np = *pp) != 0; pp = &np->sibling){
+      acquire(&np->lock);
+      if(np->state == ZOMBIE){
+        // Found one.
+        pid = np->pid;
+        if(addr != 0 && copyout(p->pagetable, addr, (char *)&np->xstate,
+                                sizeof(np->xstate)) < 0) {
           release(&np->lock);
           release(&p->lock);
-          return pid;
+          return -1;
         }
+        *pp = np->sibling;
+        freeproc(np);
         release(&np->lock);
+        release(&p->lock);
+        return pid;
       }
+      release(&np->lock);
     }
 
     // No point waiting if we don't have any children.
-    if(!havekids || p->killed){
+    if(p->children == 0 || p->killed){
       release(&p->lock);
       return -1;
     }
@@ -446,44 +615,47 @@ scheduler(void)
 {
   struct proc *p;
   struct cpu *c = mycpu();
+  int id = cpuid();
   
   c->proc = 0;
   for(;;){
     // Avoid deadlock by giving devices a chance to interrupt.
     intr_on();
 
-    // Run the for loop with interrupts off to avoid
+    // Look for work with interrupts off to avoid
     // a race between an interrupt and WFI, which would
     // cause a lost wakeup.
     intr_off();
 
-    int found = 0;
-    for(p = proc; p < &proc[NPROC]; p++) {
-      acquire(&p->lock);
-      if(p->state == RUNNABLE) {
-        // Switch to chosen process.  It is the process's job
-        // to release its lock and then reacquire it
-        // before jumping back to us.
-        p->state = RUNNING;
-        c->proc = p;
-        swtch(&c->scheduler, &p->context);
-
-        // Process is done running for now.
-        // It should have changed its p->state before coming back.
-        c->proc = 0;
-
-        found = 1;
-      }
-
-      // ensure that release() doesn't enable interrupts.
-      // again to avoid a race between interrupt and WFI.
-      c->intena = 0;
-
-      release(&p->lock);
-    }
-    if(found == 0){
+    if((p = runqget(id)) == 0 && (p = runqsteal(id)) == 0){
+      // a process made RUNNABLE on another CPU is
+      // noticed here after the next timer interrupt.
       asm volatile("wfi");
+      continue;
     }
+
+    // p is off the queues and RUNNABLE, so it is ours; its
+    // lock may still be held briefly by the CPU that queued it.
+    acquire(&p->lock);
+    if(p->state != RUNNABLE)
+      panic("scheduler");
+
+    // Switch to chosen process.  It is the process's job
+    // to release its lock and then reacquire it
+    // before jumping back to us.
+    p->state = RUNNING;
+    c->proc = p;
+    swtch(&c->scheduler, &p->context);
+
+    // Process is done running for now.
+    // It should have changed its p->state before coming back.
+    c->proc = 0;
+
+    // ensure that release() doesn't enable interrupts.
+    // again to avoid a race between interrupt and WFI.
+    c->intena = 0;
+
+    release(&p->lock);
   }
 }
 
@@ -520,7 +692,7 @@ yield(void)
 {
   struct proc *p = myproc();
   acquire(&p->lock);
-  p->state = RUNNABLE;
+  runqadd(p);
   sched();
   release(&p->lock);
 }
@@ -546,20 +718,44 @@ forkret(void)
   usertrapret();
 }
 
+// A kernel thread's very first scheduling by scheduler()
+// will swtch to kthreadret.
+static void
+kthreadret(void)
+{
+  struct proc *p = myproc();
+
+  // Still holding p->lock from scheduler.
+  release(&p->lock);
+
+  p->kfn(p->karg);
+  panic("kthread returned");
+}
+
 // Atomically release lock and sleep on chan.
 // Reacquires lock when awakened.
+// A process sleeping with its own p->lock (wait()) is not
+// put on a wait queue; only wakeup1() and kill() wake it.
 void
 sleep(void *chan, struct spinlock *lk)
 {
   struct proc *p = myproc();
+  struct sleepq *q = 0;
   
   // Must acquire p->lock in order to
   // change p->state and then call sched.
-  // Once we hold p->lock, we can be
+  // Once we hold the wait queue lock, we can be
   // guaranteed that we won't miss any wakeup
-  // (wakeup locks p->lock),
+  // (wakeup locks it, then p->lock),
   // so it's okay to release lk.
   if(lk != &p->lock){  //DOC: sleeplock0
+    q = sqhash(chan);
+    acquire(&q->lock);
+    p->sqprev = 0;
+    p->sqnext = q->head;
+    if(q->head)
+      q->head->sqprev = p;
+    q->head = p;
     acquire(&p->lock);  //DOC: sleeplock1
     release(lk);
   }
@@ -567,15 +763,25 @@ sleep(void *chan, struct spinlock *lk)
   // Go to sleep.
   p->chan = chan;
   p->state = SLEEPING;
+  if(q)
+    release(&q->lock);
 
   sched();
 
   // Tidy up.
   p->chan = 0;
 
-  // Reacquire original lock.
+  // Leave the wait queue and reacquire original lock.
   if(lk != &p->lock){
     release(&p->lock);
+    acquire(&q->lock);
+    if(p->sqprev)
+      p->sqprev->sqnext = p->sqnext;
+    else
+      q->head = p->sqnext;
+    if(p->sqnext)
+      p->sqnext->sqprev = p->sqprev;
+    release(&q->lock);
     acquire(lk);
   }
 }
@@ -585,15 +791,20 @@ sleep(void *chan, struct spinlock *lk)
 void
 wakeup(void *chan)
 {
+  struct sleepq *q = sqhash(chan);
   struct proc *p;
 
-  for(p = proc; p < &proc[NPROC]; p++) {
+  acquire(&q->lock);
+  for(p = q->head; p; p = p->sqnext) {
+    // p may have been woken already and not yet have
+    // unlinked itself, or be sleeping on another chan.
     acquire(&p->lock);
     if(p->state == SLEEPING && p->chan == chan) {
-      p->state = RUNNABLE;
+      runqadd(p);
     }
     release(&p->lock);
   }
+  release(&q->lock);
 }
 
 // Wake up p if it is sleeping in wait(); used by exit().
@@ -604,7 +815,7 @@ wakeup1(struct proc *p)
   if(!holding(&p->lock))
     panic("wakeup1");
   if(p->chan == p && p->state == SLEEPING) {
-    p->state = RUNNABLE;
+    runqadd(p);
   }
 }
 
@@ -614,22 +825,35 @@ wakeup1(struct proc *p)
 int
 kill(int pid)
 {
+  struct pidhash *h;
   struct proc *p;
 
-  for(p = proc; p < &proc[NPROC]; p++){
-    acquire(&p->lock);
-    if(p->pid == pid){
-      p->killed = 1;
-      if(p->state == SLEEPING){
-        // Wake process from sleep().
-        p->state = RUNNABLE;
-      }
-      release(&p->lock);
-      return 0;
-    }
+  if(pid <= 0)
+    return -1;
+
+  h = &pidhash[pid % NPIDHASH];
+  acquire(&h->lock);
+  for(p = h->head; p && p->pid != pid; p = p->pidnext)
+    ;
+  release(&h->lock);
+  if(p == 0)
+    return -1;
+
+  // p may have been freed since we dropped the hash lock,
+  // but proc structs are never freed and pids never reused,
+  // so checking its pid again under p->lock is enough.
+  acquire(&p->lock);
+  if(p->pid != pid){
     release(&p->lock);
+    return -1;
   }
-  return -1;
+  p->killed = 1;
+  if(p->state == SLEEPING){
+    // Wake process from sleep().
+    runqadd(p);
+  }
+  release(&p->lock);
+  return 0;
 }
 
 // Copy to either a user address, or kernel address,
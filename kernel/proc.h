@@ -82,6 +82,17 @@ struct trapframe {
 
 enum procstate { UNUSED, SLEEPING, RUNNABLE, RUNNING, ZOMBIE };
 
+// A region of user memory mapped from a file by mmap().
+// Pages are read in from the file on first touch.
+struct vma {
+  uint64 addr;                 // Start, page aligned
+  uint64 len;                  // Length in bytes; 0 if slot is free
+  int prot;                    // PROT_READ, PROT_WRITE, PROT_EXEC
+  int flags;                   // MAP_SHARED or MAP_PRIVATE
+  struct file *f;              // Mapped file; holds a reference
+  uint off;                    // File offset of addr
+};
+
 // Per-process state
 struct proc {
   struct spinlock lock;
@@ -89,10 +100,17 @@ struct proc {
   // p->lock must be held when using these:
   enum procstate state;        // Process state
   struct proc *parent;         // Parent process
+  struct proc *children;       // First child; parent's p->lock protects
+  struct proc *sibling;        //   children and their sibling links
   void *chan;                  // If non-zero, sleeping on chan
   int killed;                  // If non-zero, have been killed
   int xstate;                  // Exit status to be returned to parent's wait
   int pid;                     // Process ID
+  struct proc *rqnext;         // Next on run queue; runq lock protects
+  struct proc *sqnext;         // Wait queue links; sleepq lock protects
+  struct proc *sqprev;
+  struct proc *nextfree;       // Next UNUSED proc; procfree lock protects
+  struct proc *pidnext;        // Pid hash chain; pidhash lock protects
 
   // these are private to the process, so p->lock need not be held.
   uint64 kstack;               // Virtual address of kernel stack
@@ -101,6 +119,9 @@ struct proc {
   struct trapframe *tf;        // data page for trampoline.S
   struct context context;      // swtch() here to run process
   struct file *ofile[NOFILE];  // Open files
+  struct vma vma[NVMA];        // mmap()ed regions
   struct inode *cwd;           // Current directory
   char name[16];               // Process name (debugging)
+  void (*kfn)(int);            // Entry point, if a kernel thread
+  int karg;                    // Argument to kfn
 };
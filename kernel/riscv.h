@@ -248,6 +248,16 @@ r_mcounteren()
   return x;
 }
 
+// cycle counter; readable in supervisor mode once
+// start() sets mcounteren.CY.
+static inline uint64
+r_cycle()
+{
+  uint64 x;
+  asm volatile("csrr %0, cycle" : "=r" (x) );
+  return x;
+}
+
 // machine-mode cycle counter
 static inline uint64
 r_time()
@@ -331,6 +341,8 @@ sfence_vma()
 #define PTE_W (1L << 2)
 #define PTE_X (1L << 3)
 #define PTE_U (1L << 4) // 1 -> user can access
+#define PTE_D (1L << 7) // dirty: set by the hardware on a store
+#define PTE_COW (1L << 8) // copy-on-write (a RSW bit, ignored by h/w)
 
 // shift a physical address to the right place for a PTE.
 #define PA2PTE(pa) ((((uint64)pa) >> 12) << 10)
@@ -0,0 +1,149 @@
+// Slab allocator for small kernel objects.
+//
+// A cache hands out objects of one size, carved from
+// SLABSIZE-byte slabs obtained from the buddy allocator.
+// A slab starts with a struct slab, followed by its objects;
+// free objects are chained through their first word. Buddy
+// blocks are aligned to their size, so an object's slab is
+// found by rounding its address down to SLABSIZE.
+//
+// Each CPU keeps a magazine of up to MAGSIZE free objects
+// per cache, so most slaballoc() and slabfree() calls take
+// no lock. An empty magazine is refilled, and a full one
+// drained, MAGSIZE/2 objects at a time under the cache lock.
+// A slab whose objects are all free goes back to the buddy
+// allocator.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "spinlock.h"
+#include "riscv.h"
+#include "defs.h"
+#include "slab.h"
+
+#define SLABSIZE PGSIZE
+
+struct slab {
+  struct list link;        // on c->partial; must be first
+  struct slabcache *c;
+  void *free;              // chain of free objects
+  uint nfree;
+};
+
+void
+slabinit(struct slabcache *c, char *name, uint size)
+{
+  initlock(&c->lock, name);
+  c->name = name;
+  c->size = (size + 7) & ~7;
+  c->nper = (SLABSIZE - sizeof(struct slab)) / c->size;
+  if(c->size == 0 || c->nper == 0)
+    panic("slabinit");
+  lst_init(&c->partial);
+  for(int i = 0; i < NCPU; i++)
+    c->mag[i].n = 0;
+}
+
+// Get a new slab from the buddy allocator and put it on
+// c's partial list. Caller holds c->lock.
+static struct slab*
+slabnew(struct slabcache *c)
+{
+  struct slab *s;
+  char *p;
+
+  if((s = bd_malloc(SLABSIZE)) == 0)
+    return 0;
+  if((uint64)s % SLABSIZE)
+    panic("slabnew");
+  s->c = c;
+  s->free = 0;
+  p = (char*)(s + 1);
+  for(int i = 0; i < c->nper; i++, p += c->size){
+    *(void**)p = s->free;
+    s->free = p;
+  }
+  s->nfree = c->nper;
+  lst_push(&c->partial, s);
+  return s;
+}
+
+// Move up to n free objects from c's slabs into m.
+// Caller holds c->lock.
+static void
+slabfill(struct slabcache *c, struct magazine *m, int n)
+{
+  struct slab *s;
+  void *p;
+
+  for(; n > 0; n--){
+    if(lst_empty(&c->partial) && slabnew(c) == 0)
+      break;
+    s = (struct slab*)c->partial.next;
+    p = s->free;
+    s->free = *(void**)p;
+    if(--s->nfree == 0)
+      lst_remove(&s->link);
+    m->obj[m->n++] = p;
+  }
+}
+
+// Put object p back on its slab. Caller holds c->lock.
+static void
+slabput(struct slabcache *c, void *p)
+{
+  struct slab *s;
+
+  s = (struct slab*)((uint64)p & ~(uint64)(SLABSIZE - 1));
+  if(s->c != c)
+    panic("slabfree");
+  *(void**)p = s->free;
+  s->free = p;
+  if(s->nfree++ == 0)
+    lst_push(&c->partial, s);
+  if(s->nfree == c->nper){
+    lst_remove(&s->link);
+    bd_free(s);
+  }
+}
+
+// Allocate an object from c. Its contents are undefined.
+// Returns 0 if the memory can't be allocated.
+void*
+slaballoc(struct slabcache *c)
+{
+  struct magazine *m;
+  void *p;
+
+  push_off();
+  m = &c->mag[cpuid()];
+  if(m->n == 0){
+    acquire(&c->lock);
+    slabfill(c, m, MAGSIZE/2);
+    release(&c->lock);
+  }
+  p = 0;
+  if(m->n > 0)
+    p = m->obj[--m->n];
+  pop_off();
+  return p;
+}
+
+// Free an object allocated from c.
+void
+slabfree(struct slabcache *c, void *p)
+{
+  struct magazine *m;
+
+  push_off();
+  m = &c->mag[cpuid()];
+  if(m->n == MAGSIZE){
+    acquire(&c->lock);
+    while(m->n > MAGSIZE/2)
+      slabput(c, m->obj[--m->n]);
+    release(&c->lock);
+  }
+  m->obj[m->n++] = p;
+  pop_off();
+}
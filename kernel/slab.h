@@ -0,0 +1,17 @@
+// Per-CPU stash of free objects; see slab.c.
+#define MAGSIZE 8
+
+struct magazine {
+  int n;                 // objects in obj[]
+  void *obj[MAGSIZE];
+};
+
+// A cache of equal-sized kernel objects.
+struct slabcache {
+  struct spinlock lock;  // protects partial and the slabs
+  char *name;
+  uint size;             // object size, rounded to 8 bytes
+  uint nper;             // objects per slab
+  struct list partial;   // slabs with at least one free object
+  struct magazine mag[NCPU];
+};
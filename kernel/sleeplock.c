@@ -12,7 +12,8 @@
 void
 initsleeplock(struct sleeplock *lk, char *name)
 {
-  initlock(&lk->lk, "sleep lock");
+  // named after the sleep-lock, so its statistics are too.
+  initlock(&lk->lk, name);
   lk->name = name;
   lk->locked = 0;
   lk->pid = 0;
@@ -22,8 +23,13 @@ void
 acquiresleep(struct sleeplock *lk)
 {
   acquire(&lk->lk);
-  while (lk->locked) {
-    sleep(lk, &lk->lk);
+  if(lk->locked){
+    uint64 t0 = r_cycle();
+    while (lk->locked) {
+      sleep(lk, &lk->lk);
+    }
+    lk->lk.nsleep++;
+    lk->lk.sleepwait += r_cycle() - t0;
   }
   lk->locked = 1;
   lk->pid = myproc()->pid;
@@ -6,6 +6,10 @@
 #include "spinlock.h"
 #include "riscv.h"
 #include "proc.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "file.h"
+#include "lockstat.h"
 #include "defs.h"
 
 #define NLOCK 1000
@@ -13,15 +17,46 @@
 static int nlock;
 static struct spinlock *locks[NLOCK];
 
+// Back-off while spinning, in iterations of spindelay().
+// TICKETLOCK waiters delay BACKOFF_TICKET per waiter ahead
+// of them; test-and-set waiters double their delay after each
+// failed attempt, from BACKOFF_MIN up to BACKOFF_MAX.
+#define BACKOFF_TICKET 64
+#define BACKOFF_MIN 4
+#define BACKOFF_MAX 1024
+
+static inline void
+spindelay(uint n)
+{
+  for(uint i = 0; i < n; i++)
+    asm volatile("nop");
+}
+
+static void
+lockstatclear(struct spinlock *lk)
+{
+  lk->hold = 0;
+  lk->maxhold = 0;
+  for(int i = 0; i < NCPU; i++)
+    lk->ncpu[i] = 0;
+  lk->nsleep = 0;
+  lk->sleepwait = 0;
+}
+
 // assumes locks are not freed
 void
 initlock(struct spinlock *lk, char *name)
 {
   lk->name = name;
   lk->locked = 0;
+#ifdef TICKETLOCK
+  lk->next = 0;
+  lk->owner = 0;
+#endif
   lk->cpu = 0;
   lk->nts = 0;
   lk->n = 0;
+  lockstatclear(lk);
   if(nlock >= NLOCK)
     panic("initlock");
   locks[nlock] = lk;
@@ -38,15 +73,36 @@ acquire(struct spinlock *lk)
     panic("acquire");
 
   __sync_fetch_and_add(&(lk->n), 1);
-    
+
+#ifdef TICKETLOCK
+  // Take a ticket and wait for lk->owner to reach it, so CPUs
+  // are served in arrival order. Each waiter backs off in
+  // proportion to its distance from the front of the queue,
+  // so only the next in line polls lk->owner closely.
+  uint t = __sync_fetch_and_add(&lk->next, 1);
+  uint d;
+  while((d = t - *(volatile uint *)&lk->owner) != 0){
+    __sync_fetch_and_add(&lk->nts, 1);
+    spindelay(d * BACKOFF_TICKET);
+  }
+#else
   // On RISC-V, sync_lock_test_and_set turns into an atomic swap:
   //   a5 = 1
   //   s1 = &lk->locked
   //   amoswap.w.aq a5, a5, (s1)
+  // After a failed swap, back off, then wait with plain loads
+  // (which hit in this CPU's cache) until the lock looks free.
+  uint delay = BACKOFF_MIN;
   while(__sync_lock_test_and_set(&lk->locked, 1) != 0) {
-     __sync_fetch_and_add(&lk->nts, 1);
+    __sync_fetch_and_add(&lk->nts, 1);
+    spindelay(delay);
+    if(delay < BACKOFF_MAX)
+      delay *= 2;
+    while(*(volatile uint *)&lk->locked)
+      ;
   }
-  
+#endif
+
   // Tell the C compiler and the processor to not move loads or stores
   // past this point, to ensure that the critical section's memory
   // references happen strictly after the lock is acquired.
@@ -54,7 +110,12 @@ acquire(struct spinlock *lk)
   __sync_synchronize();
 
   // Record info about lock acquisition for holding() and debugging.
+#ifdef TICKETLOCK
+  lk->locked = 1;
+#endif
   lk->cpu = mycpu();
+  lk->ncpu[cpuid()]++;
+  lk->tstart = r_cycle();
 }
 
 // Release the lock.
@@ -64,7 +125,15 @@ release(struct spinlock *lk)
   if(!holding(lk))
     panic("release");
 
+  uint64 t = r_cycle() - lk->tstart;
+  lk->hold += t;
+  if(t > lk->maxhold)
+    lk->maxhold = t;
+
   lk->cpu = 0;
+#ifdef TICKETLOCK
+  lk->locked = 0;
+#endif
 
   // Tell the C compiler and the CPU to not move loads or stores
   // past this point, to ensure that all the stores in the critical
@@ -74,6 +143,10 @@ release(struct spinlock *lk)
   // On RISC-V, this emits a fence instruction.
   __sync_synchronize();
 
+#ifdef TICKETLOCK
+  // Serve the next ticket. Only the holder writes lk->owner.
+  __sync_fetch_and_add(&lk->owner, 1);
+#else
   // Release the lock, equivalent to lk->locked = 0.
   // This code doesn't use a C assignment, since the C standard
   // implies that an assignment might be implemented with
@@ -82,6 +155,7 @@ release(struct spinlock *lk)
   //   s1 = &lk->locked
   //   amoswap.w zero, zero, (s1)
   __sync_lock_release(&lk->locked);
+#endif
 
   pop_off();
 }
@@ -178,3 +252,52 @@ sys_ntas(void)
   }
   return tot;
 }
+
+// Read lock statistics records, starting at record
+// f->off / sizeof(struct lockstat). Only whole records
+// are returned.
+static int
+lockstatread(struct file *f, int user_dst, uint64 dst, int n)
+{
+  struct lockstat st;
+  struct spinlock *lk;
+  int i, tot;
+
+  tot = 0;
+  for(i = f->off / sizeof(st); i < nlock && n - tot >= sizeof(st); i++){
+    lk = locks[i];
+    memset(&st, 0, sizeof(st));
+    safestrcpy(st.name, lk->name, sizeof(st.name));
+    st.n = lk->n;
+    st.nts = lk->nts;
+    st.hold = lk->hold;
+    st.maxhold = lk->maxhold;
+    memmove(st.ncpu, lk->ncpu, sizeof(st.ncpu));
+    st.nsleep = lk->nsleep;
+    st.sleepwait = lk->sleepwait;
+    if(either_copyout(user_dst, dst + tot, &st, sizeof(st)) < 0)
+      break;
+    tot += sizeof(st);
+  }
+  f->off += tot;
+  return tot;
+}
+
+// Any write clears the statistics of every lock.
+static int
+lockstatwrite(struct file *f, int user_src, uint64 src, int n)
+{
+  for(int i = 0; i < nlock; i++){
+    locks[i]->n = 0;
+    locks[i]->nts = 0;
+    lockstatclear(locks[i]);
+  }
+  return n;
+}
+
+void
+lockstatinit(void)
+{
+  devsw[LOCKSTAT].read = lockstatread;
+  devsw[LOCKSTAT].write = lockstatwrite;
+}
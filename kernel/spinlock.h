@@ -1,11 +1,23 @@
 // Mutual exclusion lock.
 struct spinlock {
   uint locked;       // Is the lock held?
+#ifdef TICKETLOCK
+  uint next;         // next ticket to hand out
+  uint owner;        // ticket now being served
+#endif
 
   // For debugging:
   char *name;        // Name of lock.
   struct cpu *cpu;   // The cpu holding the lock.
-  uint n;
-  uint nts;
+  uint n;            // acquire() calls
+  uint nts;          // test-and-set spins in acquire()
+
+  // For lock statistics; see lockstat.h.
+  uint64 tstart;     // cycle count when acquired
+  uint64 hold;       // total cycles held
+  uint64 maxhold;    // longest hold, in cycles
+  uint ncpu[NCPU];   // acquisitions by each CPU
+  uint nsleep;       // waits by acquiresleep() (sleep-lock's lk)
+  uint64 sleepwait;  // cycles acquiresleep() waited
 };
 
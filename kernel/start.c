@@ -38,6 +38,9 @@ start()
   w_mideleg(0xffff);
   w_sie(r_sie() | SIE_SEIE | SIE_STIE | SIE_SSIE);
 
+  // let supervisor mode read the cycle counter, for lock statistics.
+  w_mcounteren(r_mcounteren() | 1);
+
   // ask for clock interrupts.
   timerinit();
 
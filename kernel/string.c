@@ -1,13 +1,39 @@
 #include "types.h"
 
+// memset, memcmp and memmove work a 64-bit word at a time
+// once the pointers are aligned, eight words per iteration on
+// large buffers, and a byte at a time only at the ends or
+// when the two pointers are not aligned alike.
+
+#define WSIZE sizeof(uint64)
+#define WMASK (WSIZE - 1)
+
 void*
 memset(void *dst, int c, uint n)
 {
-  char *cdst = (char *) dst;
-  int i;
-  for(i = 0; i < n; i++){
-    cdst[i] = c;
+  uchar *d = (uchar *) dst;
+  uint64 w, *wd;
+
+  while(n > 0 && ((uint64)d & WMASK)){
+    *d++ = c;
+    n--;
+  }
+  if(n >= WSIZE){
+    w = (uchar)c;
+    w |= w << 8;
+    w |= w << 16;
+    w |= w << 32;
+    wd = (uint64 *) d;
+    for(; n >= 8*WSIZE; n -= 8*WSIZE, wd += 8){
+      wd[0] = w; wd[1] = w; wd[2] = w; wd[3] = w;
+      wd[4] = w; wd[5] = w; wd[6] = w; wd[7] = w;
+    }
+    for(; n >= WSIZE; n -= WSIZE)
+      *wd++ = w;
+    d = (uchar *) wd;
   }
+  while(n-- > 0)
+    *d++ = c;
   return dst;
 }
 
@@ -18,6 +44,17 @@ memcmp(const void *v1, const void *v2, uint n)
 
   s1 = v1;
   s2 = v2;
+  if((((uint64)s1 ^ (uint64)s2) & WMASK) == 0){
+    while(n > 0 && ((uint64)s1 & WMASK)){
+      if(*s1 != *s2)
+        return *s1 - *s2;
+      s1++, s2++, n--;
+    }
+    // skip equal words; the bytes below find the difference.
+    while(n >= WSIZE && *(uint64 *)s1 == *(uint64 *)s2){
+      s1 += WSIZE, s2 += WSIZE, n -= WSIZE;
+    }
+  }
   while(n-- > 0){
     if(*s1 != *s2)
       return *s1 - *s2;
@@ -30,19 +67,58 @@ memcmp(const void *v1, const void *v2, uint n)
 void*
 memmove(void *dst, const void *src, uint n)
 {
-  const char *s;
-  char *d;
+  const uchar *s;
+  uchar *d;
+  const uint64 *ws;
+  uint64 *wd;
+  int aligned;
 
   s = src;
   d = dst;
+  aligned = (((uint64)s ^ (uint64)d) & WMASK) == 0;
   if(s < d && s + n > d){
+    // overlapping, with dst above src: copy backwards.
     s += n;
     d += n;
+    if(aligned){
+      while(n > 0 && ((uint64)d & WMASK)){
+        *--d = *--s;
+        n--;
+      }
+      ws = (const uint64 *) s;
+      wd = (uint64 *) d;
+      for(; n >= 8*WSIZE; n -= 8*WSIZE){
+        ws -= 8, wd -= 8;
+        wd[7] = ws[7]; wd[6] = ws[6]; wd[5] = ws[5]; wd[4] = ws[4];
+        wd[3] = ws[3]; wd[2] = ws[2]; wd[1] = ws[1]; wd[0] = ws[0];
+      }
+      for(; n >= WSIZE; n -= WSIZE)
+        *--wd = *--ws;
+      s = (const uchar *) ws;
+      d = (uchar *) wd;
+    }
     while(n-- > 0)
       *--d = *--s;
-  } else
+  } else {
+    if(aligned){
+      while(n > 0 && ((uint64)d & WMASK)){
+        *d++ = *s++;
+        n--;
+      }
+      ws = (const uint64 *) s;
+      wd = (uint64 *) d;
+      for(; n >= 8*WSIZE; n -= 8*WSIZE, ws += 8, wd += 8){
+        wd[0] = ws[0]; wd[1] = ws[1]; wd[2] = ws[2]; wd[3] = ws[3];
+        wd[4] = ws[4]; wd[5] = ws[5]; wd[6] = ws[6]; wd[7] = ws[7];
+      }
+      for(; n >= WSIZE; n -= WSIZE)
+        *wd++ = *ws++;
+      s = (const uchar *) ws;
+      d = (uchar *) wd;
+    }
     while(n-- > 0)
       *d++ = *s++;
+  }
 
   return dst;
 }
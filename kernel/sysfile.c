@@ -15,6 +15,7 @@
 #include "sleeplock.h"
 #include "file.h"
 #include "fcntl.h"
+#include "memlayout.h"
 
 // Fetch the nth word-sized system call argument as a file descriptor
 // and return both the descriptor and the corresponding struct file.
@@ -104,6 +105,29 @@ sys_close(void)
   return 0;
 }
 
+// Wait until the updates of every ended system call to the
+// file system holding fd's file, including the caller's, are
+// on disk. end_op() doesn't wait for that.
+uint64
+sys_fsync(void)
+{
+  struct file *f;
+
+  if(argfd(0, 0, &f) < 0)
+    return -1;
+  if(f->type == FD_INODE || f->type == FD_DEVICE)
+    log_sync(f->ip->dev);
+  return 0;
+}
+
+// Like fsync(), for the root file system.
+uint64
+sys_sync(void)
+{
+  log_sync(ROOTDEV);
+  return 0;
+}
+
 uint64
 sys_fstat(void)
 {
@@ -218,6 +242,7 @@ sys_unlink(void)
   memset(&de, 0, sizeof(de));
   if(writei(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
     panic("unlink: writei");
+  dcremove(dp, name);
   if(ip->type == T_DIR){
     dp->nlink--;
     iupdate(dp);
@@ -258,7 +283,7 @@ create(char *path, short type, short major, short minor)
     return 0;
   }
 
-  if((ip = ialloc(dp->dev, type)) == 0)
+  if((ip = ialloc(dp->dev, type, dp->inum)) == 0)
     panic("create: ialloc");
 
   ilock(ip);
@@ -339,6 +364,7 @@ sys_open(void)
   }
   f->ip = ip;
   f->off = 0;
+  f->ranext = 0;
   f->readable = !(omode & O_WRONLY);
   f->writable = (omode & O_WRONLY) || (omode & O_RDWR);
 
@@ -413,20 +439,37 @@ uint64
 sys_exec(void)
 {
   char path[MAXPATH], *argv[MAXARG];
-  int i;
-  uint64 uargv, uarg;
+  int i, j, n;
+  uint64 uargv, uarg, uargs[MAXARG];
+  struct proc *p = myproc();
 
   if(argstr(0, path, MAXPATH) < 0 || argaddr(1, &uargv) < 0){
     return -1;
   }
   memset(argv, 0, sizeof(argv));
+  n = 0;
   for(i=0;; i++){
     if(i >= NELEM(argv)){
       goto bad;
     }
-    if(fetchaddr(uargv+sizeof(uint64)*i, (uint64*)&uarg) < 0){
-      goto bad;
+    if(i == n){
+      // fetch the rest of uargv[]'s page with one copyin,
+      // without reading past the end of user memory.
+      uarg = uargv + sizeof(uint64)*i;
+      if(uarg >= p->sz || uarg + sizeof(uint64) > p->sz)
+        goto bad;
+      j = (PGROUNDDOWN(uarg) + PGSIZE - uarg) / sizeof(uint64);
+      if(j == 0)
+        j = 1;  // a misaligned pointer straddles the page end
+      if(j > NELEM(uargs) - i)
+        j = NELEM(uargs) - i;
+      if((p->sz - uarg) / sizeof(uint64) < j)
+        j = (p->sz - uarg) / sizeof(uint64);
+      if(copyin(p->pagetable, (char*)&uargs[i], uarg, j*sizeof(uint64)) < 0)
+        goto bad;
+      n = i + j;
     }
+    uarg = uargs[i];
     if(uarg == 0){
       argv[i] = 0;
       break;
@@ -483,3 +526,256 @@ sys_pipe(void)
   return 0;
 }
 
+
+// Memory-mapped files.
+//
+// mmap() only records the mapping in a free p->vma[] slot;
+// pages are read from the file by mmapfault() when the
+// process first touches them. The pages of MAP_SHARED
+// mappings that were written are written back to the file
+// by munmap() and by exit(). Mappings are placed downward
+// from the trapframe, far above anything sbrk() can reach.
+//
+// Only a fault from user code brings a page in: copyin() and
+// copyout() don't, since they may run with an inode locked
+// that the fault would have to lock too. So a system call
+// given a buffer in a page of a mapping that hasn't been
+// touched yet fails, as for any unmapped address.
+
+// Return the mapping of p that contains va, or 0.
+static struct vma*
+vmafind(struct proc *p, uint64 va)
+{
+  struct vma *v;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++){
+    if(v->len > 0 && va >= v->addr && va < v->addr + v->len)
+      return v;
+  }
+  return 0;
+}
+
+uint64
+sys_mmap(void)
+{
+  uint64 addr, va;
+  int len, prot, flags, off;
+  struct file *f;
+  struct vma *v, *free;
+  struct proc *p = myproc();
+
+  if(argaddr(0, &addr) < 0 || argint(1, &len) < 0 || argint(2, &prot) < 0 ||
+     argint(3, &flags) < 0 || argfd(4, 0, &f) < 0 || argint(5, &off) < 0)
+    return -1;
+  if(len <= 0 || off < 0 || off % PGSIZE != 0)
+    return -1;
+  if(flags != MAP_SHARED && flags != MAP_PRIVATE)
+    return -1;
+  if(f->type != FD_INODE)
+    return -1;
+  if((prot & PROT_READ) && !f->readable)
+    return -1;
+  // writes to a private mapping never reach the file.
+  if((prot & PROT_WRITE) && flags == MAP_SHARED && !f->writable)
+    return -1;
+
+  // the hint in addr is ignored; go below the lowest mapping.
+  free = 0;
+  va = TRAPFRAME;
+  for(v = p->vma; v < &p->vma[NVMA]; v++){
+    if(v->len == 0){
+      if(free == 0)
+        free = v;
+    } else if(v->addr < va){
+      va = v->addr;
+    }
+  }
+  if(free == 0 || va - PGROUNDUP(len) < PHYSTOP - KERNBASE)
+    return -1;
+  va -= PGROUNDUP(len);
+
+  free->addr = va;
+  free->len = PGROUNDUP(len);
+  free->prot = prot;
+  free->flags = flags;
+  free->f = filedup(f);
+  free->off = off;
+  return va;
+}
+
+// Map the page of a mmap()ed file that contains va into p,
+// reading its contents from the file. scause is the cause of
+// the page fault: 13 for a load, 15 for a store.
+// Returns 0 on success, -1 if va is not in a mapping, the
+// mapping doesn't allow the access, the page is already
+// mapped (so the access itself was illegal), or there is
+// no memory.
+int
+mmapfault(struct proc *p, uint64 va, uint64 scause)
+{
+  struct vma *v;
+  char *mem;
+  int perm;
+
+  va = PGROUNDDOWN(va);
+  if((v = vmafind(p, va)) == 0)
+    return -1;
+  if(scause == 15 && (v->prot & PROT_WRITE) == 0)
+    return -1;
+  if(scause == 13 && (v->prot & PROT_READ) == 0)
+    return -1;
+  if(walkaddr(p->pagetable, va) != 0)
+    return -1;
+  if((mem = kalloc()) == 0)
+    return -1;
+  memset(mem, 0, PGSIZE);
+
+  // the part of the page past the end of the file stays zero.
+  ilock(v->f->ip);
+  readi(v->f->ip, 0, (uint64)mem, v->off + (va - v->addr), PGSIZE);
+  iunlock(v->f->ip);
+
+  perm = PTE_U;
+  if(v->prot & PROT_READ)
+    perm |= PTE_R;
+  if(v->prot & PROT_WRITE)
+    perm |= PTE_W;
+  if(v->prot & PROT_EXEC)
+    perm |= PTE_X;
+  if(mappages(p->pagetable, va, PGSIZE, (uint64)mem, perm) != 0){
+    kfree(mem);
+    return -1;
+  }
+  return 0;
+}
+
+// Write the pages of [va, va+len) that p has written back to
+// the mapped file, without growing the file. A page p only
+// read may be older than the file, if another process that
+// shares it wrote it back since.
+static void
+vmawriteback(struct proc *p, struct vma *v, uint64 va, uint64 len)
+{
+  struct inode *ip = v->f->ip;
+  // same limit on blocks per transaction as filewrite().
+  int max = ((MAXOPBLOCKS-1-1-2) / 2) * BSIZE;
+  uint64 a, pa;
+  uint off, n, n1, i;
+
+  for(a = va; a < va + len; a += PGSIZE){
+    if((pa = walkdirty(p->pagetable, a)) == 0)
+      continue;
+    off = v->off + (a - v->addr);
+    for(i = 0; i < PGSIZE; i += n1){
+      begin_op(ip->dev);
+      ilock(ip);
+      n = off + i < ip->size ? ip->size - (off + i) : 0;
+      n1 = PGSIZE - i;
+      if(n1 > max)
+        n1 = max;
+      if(n1 > n)
+        n1 = n;
+      if(n1 > 0)
+        writei(ip, 0, pa + i, off + i, n1);
+      iunlock(ip);
+      end_op(ip->dev);
+      if(n1 == 0)
+        break;
+    }
+  }
+}
+
+// Remove [va, va+len) from mapping v of p. The range must
+// be at the start or the end of the mapping (or all of it).
+static void
+vmaunmap(struct proc *p, struct vma *v, uint64 va, uint64 len)
+{
+  if((v->flags & MAP_SHARED) && (v->prot & PROT_WRITE))
+    vmawriteback(p, v, va, len);
+  uvmunmap(p->pagetable, va, len, 1);
+
+  if(va == v->addr){
+    v->addr += len;
+    v->off += len;
+  }
+  v->len -= len;
+  if(v->len == 0){
+    fileclose(v->f);
+    v->f = 0;
+  }
+}
+
+uint64
+sys_munmap(void)
+{
+  uint64 addr;
+  int len;
+  struct vma *v;
+  struct proc *p = myproc();
+
+  if(argaddr(0, &addr) < 0 || argint(1, &len) < 0)
+    return -1;
+  if(addr % PGSIZE != 0 || len <= 0)
+    return -1;
+  if((v = vmafind(p, addr)) == 0)
+    return -1;
+  len = PGROUNDUP(len);
+  if(addr + len > v->addr + v->len)
+    return -1;
+  // don't punch a hole in the middle of a mapping.
+  if(addr != v->addr && addr + len != v->addr + v->len)
+    return -1;
+  vmaunmap(p, v, addr, len);
+  return 0;
+}
+
+// Give child np the same mappings as p. The pages p has
+// already brought in are shared with np: those of a
+// MAP_SHARED mapping outright, so both see each other's
+// stores, and those of a MAP_PRIVATE one copy-on-write.
+// Returns 0 on success, -1 if there is no memory, in which
+// case np is left with no mappings.
+int
+mmapdup(struct proc *p, struct proc *np)
+{
+  struct vma *v;
+  int i;
+
+  for(i = 0; i < NVMA; i++){
+    v = &p->vma[i];
+    np->vma[i] = *v;
+    if(v->len == 0)
+      continue;
+    filedup(v->f);
+    if(uvmshare(p->pagetable, np->pagetable, v->addr, v->len,
+                v->flags == MAP_PRIVATE) < 0)
+      goto bad;
+  }
+  return 0;
+
+ bad:
+  // np's pages are all shared with p, so there is nothing to
+  // write back, and p holds the files, so this doesn't sleep.
+  for(; i >= 0; i--){
+    v = &np->vma[i];
+    if(v->len == 0)
+      continue;
+    uvmunmap(np->pagetable, v->addr, v->len, 1);
+    fileclose(v->f);
+    v->len = 0;
+    v->f = 0;
+  }
+  return -1;
+}
+
+// Remove all of p's mappings, for exit() and exec().
+void
+munmapall(struct proc *p)
+{
+  struct vma *v;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++){
+    if(v->len > 0)
+      vmaunmap(p, v, v->addr, v->len);
+  }
+}
@@ -38,17 +38,29 @@ sys_wait(void)
   return wait(p);
 }
 
+// Grow the heap lazily: only move p->sz, and let
+// usertrap() allocate each page on its first use.
+// Shrinking frees the pages right away.
 uint64
 sys_sbrk(void)
 {
-  int addr;
+  uint64 addr;
   int n;
+  struct proc *p = myproc();
 
   if(argint(0, &n) < 0)
     return -1;
-  addr = myproc()->sz;
-  if(growproc(n) < 0)
-    return -1;
+  addr = p->sz;
+  if(n < 0){
+    if(addr + n > addr || growproc(n) < 0)
+      return -1;
+  } else {
+    // a heap bigger than physical memory could never
+    // be backed, so refuse it up front.
+    if(addr + n > PHYSTOP - KERNBASE)
+      return -1;
+    p->sz = addr + n;
+  }
   return addr;
 }
 
@@ -70,6 +70,14 @@ usertrap(void)
     syscall();
   } else if((which_dev = devintr()) != 0){
     // ok
+  } else if(r_scause() == 15 && uvmcow(p->pagetable, PGROUNDDOWN(r_stval())) == 0){
+    // store to a copy-on-write page; it now has its own copy.
+  } else if((r_scause() == 13 || r_scause() == 15) &&
+            uvmlazy(p->pagetable, r_stval()) == 0){
+    // first touch of a heap page; sbrk() left it unallocated.
+  } else if((r_scause() == 13 || r_scause() == 15) &&
+            mmapfault(p, r_stval(), r_scause()) == 0){
+    // first touch of a page of a mmap()ed file.
   } else {
     printf("usertrap(): unexpected scause %p (%s) pid=%d\n", r_scause(), scause_desc(r_scause()), p->pid);
     printf("            sepc=%p stval=%p\n", r_sepc(), r_stval());
@@ -44,8 +44,10 @@
 #define VIRTIO_RING_F_EVENT_IDX     29
 
 // this many virtio descriptors.
-// must be a power of two.
-#define NUM 8
+// must be a power of two, and small enough that
+// the descriptors and avail ring fit in one page.
+// each request uses three, so NUM/3 can be in flight.
+#define NUM 32
 
 struct VRingDesc {
   uint64 addr;
@@ -65,6 +67,15 @@ struct VRingUsedElem {
 #define VIRTIO_BLK_T_IN  0 // read the disk
 #define VIRTIO_BLK_T_OUT 1 // write the disk
 
+// the format of the first descriptor in a disk request.
+// to be followed by two more descriptors containing
+// the block, and a one-byte status.
+struct virtio_blk_outhdr {
+  uint32 type; // VIRTIO_BLK_T_IN or ..._OUT
+  uint32 reserved;
+  uint64 sector;
+};
+
 struct UsedArea {
   uint16 flags;
   uint16 id;
@@ -33,7 +33,8 @@ struct disk {
 
   // our own book-keeping.
   char free[NUM];  // is a descriptor free?
-  uint16 used_idx; // we've looked this far in used[2..NUM].
+  uint16 used_idx; // we've looked this far in used->elems[].
+  int pending;     // requests submitted since the last notify.
 
   // track info about in-flight operations,
   // for use when completion interrupt arrives.
@@ -43,6 +44,10 @@ struct disk {
     char status;
   } info[NUM];
 
+  // disk command headers.
+  // one-for-one with descriptors, for convenience.
+  struct virtio_blk_outhdr ops[NUM];
+
   // initialized?
   int init;
 
@@ -177,8 +182,24 @@ alloc3_desc(int n, int *idx)
   return 0;
 }
 
+// Tell the device about requests queued by virtio_disk_submit().
+// Caller holds disk[n].vdisk_lock.
+static void
+notify(int n)
+{
+  if(disk[n].pending){
+    disk[n].pending = 0;
+    *R(n, VIRTIO_MMIO_QUEUE_NOTIFY) = 0; // value is queue number
+  }
+}
+
+// Queue a read or write of b on disk n, without waiting for
+// it to finish and without notifying the device; several
+// requests can be queued and then started together with
+// virtio_disk_kick(). b->disk is 1 until virtio_disk_intr()
+// sees the request complete; use virtio_disk_wait() to wait.
 void
-virtio_disk_rw(int n, struct buf *b, int write)
+virtio_disk_submit(int n, struct buf *b, int write)
 {
   uint64 sector = b->blockno * (BSIZE / 512);
 
@@ -194,29 +215,26 @@ virtio_disk_rw(int n, struct buf *b, int write)
     if(alloc3_desc(n, idx) == 0) {
       break;
     }
+    // requests we queued but haven't started can't
+    // complete, so start them before waiting.
+    notify(n);
     sleep(&disk[n].free[0], &disk[n].vdisk_lock);
   }
   
   // format the three descriptors.
   // qemu's virtio-blk.c reads them.
 
-  struct virtio_blk_outhdr {
-    uint32 type;
-    uint32 reserved;
-    uint64 sector;
-  } buf0;
+  struct virtio_blk_outhdr *buf0 = &disk[n].ops[idx[0]];
 
   if(write)
-    buf0.type = VIRTIO_BLK_T_OUT; // write the disk
+    buf0->type = VIRTIO_BLK_T_OUT; // write the disk
   else
-    buf0.type = VIRTIO_BLK_T_IN; // read the disk
-  buf0.reserved = 0;
-  buf0.sector = sector;
-
-  // buf0 is on a kernel stack, which is not direct mapped,
-  // thus the call to kvmpa().
-  disk[n].desc[idx[0]].addr = (uint64) kvmpa((uint64) &buf0);
-  disk[n].desc[idx[0]].len = sizeof(buf0);
+    buf0->type = VIRTIO_BLK_T_IN; // read the disk
+  buf0->reserved = 0;
+  buf0->sector = sector;
+
+  disk[n].desc[idx[0]].addr = (uint64) buf0;
+  disk[n].desc[idx[0]].len = sizeof(*buf0);
   disk[n].desc[idx[0]].flags = VRING_DESC_F_NEXT;
   disk[n].desc[idx[0]].next = idx[1];
 
@@ -229,7 +247,7 @@ virtio_disk_rw(int n, struct buf *b, int write)
   disk[n].desc[idx[1]].flags |= VRING_DESC_F_NEXT;
   disk[n].desc[idx[1]].next = idx[2];
 
-  disk[n].info[idx[0]].status = 0;
+  disk[n].info[idx[0]].status = 0xff; // device writes 0 on success
   disk[n].desc[idx[2]].addr = (uint64) &disk[n].info[idx[0]].status;
   disk[n].desc[idx[2]].len = 1;
   disk[n].desc[idx[2]].flags = VRING_DESC_F_WRITE; // device writes the status
@@ -246,37 +264,72 @@ virtio_disk_rw(int n, struct buf *b, int write)
   disk[n].avail[2 + (disk[n].avail[1] % NUM)] = idx[0];
   __sync_synchronize();
   disk[n].avail[1] = disk[n].avail[1] + 1;
+  disk[n].pending++;
 
-  *R(n, VIRTIO_MMIO_QUEUE_NOTIFY) = 0; // value is queue number
+  release(&disk[n].vdisk_lock);
+}
+
+// Start all requests queued by virtio_disk_submit().
+void
+virtio_disk_kick(int n)
+{
+  acquire(&disk[n].vdisk_lock);
+  notify(n);
+  release(&disk[n].vdisk_lock);
+}
 
-  // Wait for virtio_disk_intr() to say request has finished.
+// Wait for a submitted request on b to complete.
+void
+virtio_disk_wait(int n, struct buf *b)
+{
+  acquire(&disk[n].vdisk_lock);
+  notify(n);
   while(b->disk == 1) {
     sleep(b, &disk[n].vdisk_lock);
   }
-
-  disk[n].info[idx[0]].b = 0;
-  free_chain(n, idx[0]);
-
   release(&disk[n].vdisk_lock);
 }
 
+// Synchronously read or write b.
+void
+virtio_disk_rw(int n, struct buf *b, int write)
+{
+  virtio_disk_submit(n, b, write);
+  virtio_disk_wait(n, b);
+}
+
 void
 virtio_disk_intr(int n)
 {
   acquire(&disk[n].vdisk_lock);
 
-  while((disk[n].used_idx % NUM) != (disk[n].used->id % NUM)){
-    int id = disk[n].used->elems[disk[n].used_idx].id;
+  // tell the device we've seen this interrupt; the device
+  // won't raise the next one until we do.
+  *R(n, VIRTIO_MMIO_INTERRUPT_ACK) = *R(n, VIRTIO_MMIO_INTERRUPT_STATUS) & 0x3;
+
+  __sync_synchronize();
+
+  // the device increments used->id as it completes requests,
+  // possibly several per interrupt and in any order.
+  while(disk[n].used_idx != disk[n].used->id){
+    __sync_synchronize();
+    int id = disk[n].used->elems[disk[n].used_idx % NUM].id;
 
     if(disk[n].info[id].status != 0)
       panic("virtio_disk_intr status");
-    
-    disk[n].info[id].b->disk = 0;   // disk is done with buf
-    wakeup(disk[n].info[id].b);
 
-    disk[n].used_idx = (disk[n].used_idx + 1) % NUM;
+    struct buf *b = disk[n].info[id].b;
+    disk[n].info[id].b = 0;
+    free_chain(n, id);
+
+    b->disk = 0;   // disk is done with buf
+    if(b->async)
+      breaddone(b);  // no one is waiting; release it
+    else
+      wakeup(b);
+
+    disk[n].used_idx += 1;
   }
 
   release(&disk[n].vdisk_lock);
 }
-
@@ -5,6 +5,8 @@
 #include "riscv.h"
 #include "defs.h"
 #include "fs.h"
+#include "spinlock.h"
+#include "proc.h"
 
 /*
  * the kernel's page table.
@@ -118,6 +120,21 @@ walkaddr(pagetable_t pagetable, uint64 va)
   return pa;
 }
 
+// Like walkaddr(), but return 0 also if the page hasn't been
+// written since it was mapped.
+uint64
+walkdirty(pagetable_t pagetable, uint64 va)
+{
+  pte_t *pte;
+
+  if(walkaddr(pagetable, va) == 0)
+    return 0;
+  pte = walk(pagetable, va, 0);
+  if((*pte & PTE_D) == 0)
+    return 0;
+  return PTE2PA(*pte);
+}
+
 // add a mapping to the kernel page table.
 // only used when booting.
 // does not flush TLB or enable paging.
@@ -174,9 +191,10 @@ mappages(pagetable_t pagetable, uint64 va, uint64 size, uint64 pa, int perm)
   return 0;
 }
 
-// Remove mappings from a page table. The mappings in
-// the given range must exist. Optionally free the
-// physical memory.
+// Remove mappings from a page table. Pages in the
+// range that were never touched by a lazily-allocating
+// process have no mapping, and are skipped. Optionally
+// free the physical memory.
 void
 uvmunmap(pagetable_t pagetable, uint64 va, uint64 size, int do_free)
 {
@@ -187,12 +205,8 @@ uvmunmap(pagetable_t pagetable, uint64 va, uint64 size, int do_free)
   a = PGROUNDDOWN(va);
   last = PGROUNDDOWN(va + size - 1);
   for(;;){
-    if((pte = walk(pagetable, a, 0)) == 0)
-      panic("uvmunmap: walk");
-    if((*pte & PTE_V) == 0){
-      printf("va=%p pte=%p\n", a, *pte);
-      panic("uvmunmap: not mapped");
-    }
+    if((pte = walk(pagetable, a, 0)) == 0 || (*pte & PTE_V) == 0)
+      goto next;
     if(PTE_FLAGS(*pte) == PTE_V)
       panic("uvmunmap: not a leaf");
     if(do_free){
@@ -200,10 +214,10 @@ uvmunmap(pagetable_t pagetable, uint64 va, uint64 size, int do_free)
       kfree((void*)pa);
     }
     *pte = 0;
+  next:
     if(a == last)
       break;
     a += PGSIZE;
-    pa += PGSIZE;
   }
 }
 
@@ -310,42 +324,117 @@ uvmfree(pagetable_t pagetable, uint64 sz)
   freewalk(pagetable);
 }
 
-// Given a parent process's page table, copy
-// its memory into a child's page table.
-// Copies both the page table and the
-// physical memory.
+// Given a parent process's page table, share
+// its memory with a child's page table.
+// Copies only the page table; writable pages
+// become read-only copy-on-write pages in both,
+// and are copied by uvmcow() on the first store.
 // returns 0 on success, -1 on failure.
 // frees any allocated pages on failure.
 int
 uvmcopy(pagetable_t old, pagetable_t new, uint64 sz)
+{
+  return uvmshare(old, new, 0, sz, 1);
+}
+
+// Map the pages of [va, va+len) that are mapped in old
+// to the same physical pages in new. If cow, writable
+// pages become copy-on-write in both, as for uvmcopy();
+// otherwise both keep writing the same pages.
+// returns 0 on success, -1 on failure.
+// frees any allocated pages on failure.
+int
+uvmshare(pagetable_t old, pagetable_t new, uint64 va, uint64 len, int cow)
 {
   pte_t *pte;
-  uint64 pa, i;
+  uint64 pa, a;
   uint flags;
-  char *mem;
 
-  for(i = 0; i < sz; i += PGSIZE){
-    if((pte = walk(old, i, 0)) == 0)
-      panic("uvmcopy: pte should exist");
-    if((*pte & PTE_V) == 0)
-      panic("uvmcopy: page not present");
+  for(a = va; a < va + len; a += PGSIZE){
+    // pages not yet touched are allocated lazily
+    // by the child too.
+    if((pte = walk(old, a, 0)) == 0 || (*pte & PTE_V) == 0)
+      continue;
     pa = PTE2PA(*pte);
+    if(cow && (*pte & PTE_W))
+      *pte = (*pte & ~PTE_W) | PTE_COW;
     flags = PTE_FLAGS(*pte);
-    if((mem = kalloc()) == 0)
+    if(mappages(new, a, PGSIZE, pa, flags) != 0)
       goto err;
-    memmove(mem, (char*)pa, PGSIZE);
-    if(mappages(new, i, PGSIZE, (uint64)mem, flags) != 0){
-      kfree(mem);
-      goto err;
-    }
+    kdup((void*)pa);
   }
   return 0;
 
  err:
-  uvmunmap(new, 0, i, 1);
+  if(a > va)
+    uvmunmap(new, va, a - va, 1);
   return -1;
 }
 
+// Handle a store to the copy-on-write page at va:
+// give pagetable its own writable copy of the page,
+// or just make it writable if no one else shares it.
+// Returns 0 on success, -1 if va is not a
+// copy-on-write page or there is no memory.
+int
+uvmcow(pagetable_t pagetable, uint64 va)
+{
+  pte_t *pte;
+  uint64 pa;
+  uint flags;
+  char *mem;
+
+  if(va >= MAXVA)
+    return -1;
+  if((pte = walk(pagetable, va, 0)) == 0)
+    return -1;
+  if((*pte & PTE_V) == 0 || (*pte & PTE_U) == 0 || (*pte & PTE_COW) == 0)
+    return -1;
+  pa = PTE2PA(*pte);
+  flags = (PTE_FLAGS(*pte) | PTE_W) & ~PTE_COW;
+
+  // only this page table refers to the page, and only
+  // this process can add references to it.
+  if(krefs((void*)pa) == 1){
+    *pte = PA2PTE(pa) | flags;
+    return 0;
+  }
+
+  if((mem = kalloc()) == 0)
+    return -1;
+  memmove(mem, (char*)pa, PGSIZE);
+  *pte = PA2PTE(mem) | flags;
+  kfree((void*)pa);
+  return 0;
+}
+
+// Allocate a zeroed page for the heap address va of the
+// current process, which sbrk() promised but didn't
+// allocate. Returns 0 on success, -1 if va is outside
+// the process's memory, is already mapped (e.g. the
+// stack guard page), or there is no memory.
+int
+uvmlazy(pagetable_t pagetable, uint64 va)
+{
+  struct proc *p = myproc();
+  pte_t *pte;
+  char *mem;
+
+  va = PGROUNDDOWN(va);
+  if(p == 0 || pagetable != p->pagetable || va >= p->sz)
+    return -1;
+  if((pte = walk(pagetable, va, 0)) != 0 && (*pte & PTE_V))
+    return -1;
+  if((mem = kalloc()) == 0)
+    return -1;
+  memset(mem, 0, PGSIZE);
+  if(mappages(pagetable, va, PGSIZE, (uint64)mem, PTE_W|PTE_X|PTE_R|PTE_U) != 0){
+    kfree(mem);
+    return -1;
+  }
+  return 0;
+}
+
 // mark a PTE invalid for user access.
 // used by exec for the user stack guard page.
 void
@@ -359,6 +448,64 @@ uvmclear(pagetable_t pagetable, uint64 va)
   *pte &= ~PTE_U;
 }
 
+// Walking user memory a page at a time.
+//
+// copyin(), copyout() and copyinstr() translate each page of
+// a user range through a uwalk cursor. The cursor remembers
+// the last-level page-table page it used, so each following
+// page in the same 2-megabyte region costs an array index
+// rather than a three-level walk().
+
+struct uwalk {
+  pagetable_t pagetable;
+  uint64 base;   // user va mapped by l0[0]
+  pte_t *l0;     // last-level page-table page, or 0
+};
+
+#define L0SPAN (1L << (PGSHIFT + 9))
+
+// Return the physical address of user page va0 for the walk
+// w, or 0 if it isn't mapped for user access. Allocates lazy
+// heap pages and, when writing, breaks copy-on-write, since
+// the kernel's own accesses bypass the page protections.
+static uint64
+uwalkpa(struct uwalk *w, uint64 va0, int write)
+{
+  pte_t *pte;
+
+  if(va0 >= MAXVA)
+    return 0;
+  if(w->l0 == 0 || va0 - w->base >= L0SPAN){
+    w->l0 = 0;
+    if((pte = walk(w->pagetable, va0, 0)) != 0){
+      w->l0 = pte - PX(0, va0);
+      w->base = va0 - va0 % L0SPAN;
+    }
+  }
+  pte = w->l0 ? &w->l0[PX(0, va0)] : 0;
+
+  if(pte == 0 || (*pte & PTE_V) == 0){
+    // may map a new last-level page-table page.
+    if(uvmlazy(w->pagetable, va0) < 0)
+      return 0;
+    w->l0 = 0;
+    return uwalkpa(w, va0, write);
+  }
+  if((*pte & PTE_U) == 0)
+    return 0;
+  if(write && (*pte & PTE_COW)){
+    if(uvmcow(w->pagetable, va0) < 0)
+      return 0;
+  }
+  if(write && (*pte & PTE_W) == 0)
+    return 0;
+  // the hardware never sees this store, so record it for
+  // the write-back of a MAP_SHARED page.
+  if(write)
+    *pte |= PTE_D;
+  return PTE2PA(*pte);
+}
+
 // Copy from kernel to user.
 // Copy len bytes from src to virtual address dstva in a given page table.
 // Return 0 on success, -1 on error.
@@ -366,11 +513,11 @@ int
 copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len)
 {
   uint64 n, va0, pa0;
+  struct uwalk w = { pagetable, 0, 0 };
 
   while(len > 0){
     va0 = PGROUNDDOWN(dstva);
-    pa0 = walkaddr(pagetable, va0);
-    if(pa0 == 0)
+    if((pa0 = uwalkpa(&w, va0, 1)) == 0)
       return -1;
     n = PGSIZE - (dstva - va0);
     if(n > len)
@@ -391,11 +538,11 @@ int
 copyin(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len)
 {
   uint64 n, va0, pa0;
+  struct uwalk w = { pagetable, 0, 0 };
 
   while(len > 0){
     va0 = PGROUNDDOWN(srcva);
-    pa0 = walkaddr(pagetable, va0);
-    if(pa0 == 0)
+    if((pa0 = uwalkpa(&w, va0, 0)) == 0)
       return -1;
     n = PGSIZE - (srcva - va0);
     if(n > len)
@@ -409,6 +556,31 @@ copyin(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len)
   return 0;
 }
 
+// Return the number of bytes before the first '\0' in p[0..n),
+// or n if there is none. Looks at a word at a time once p is
+// aligned.
+static uint64
+strnlen8(const char *p, uint64 n)
+{
+  const char *s = p;
+
+  while(n > 0 && ((uint64)s & 7)){
+    if(*s == '\0')
+      return s - p;
+    s++, n--;
+  }
+  // a word has a zero byte iff this is non-zero.
+  while(n >= 8){
+    uint64 v = *(uint64 *)s;
+    if((v - 0x0101010101010101L) & ~v & 0x8080808080808080L)
+      break;
+    s += 8, n -= 8;
+  }
+  while(n > 0 && *s != '\0')
+    s++, n--;
+  return s - p;
+}
+
 // Copy a null-terminated string from user to kernel.
 // Copy bytes to dst from virtual address srcva in a given page table,
 // until a '\0', or max.
@@ -416,38 +588,27 @@ copyin(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len)
 int
 copyinstr(pagetable_t pagetable, char *dst, uint64 srcva, uint64 max)
 {
-  uint64 n, va0, pa0;
-  int got_null = 0;
+  uint64 n, m, va0, pa0;
+  struct uwalk w = { pagetable, 0, 0 };
 
-  while(got_null == 0 && max > 0){
+  while(max > 0){
     va0 = PGROUNDDOWN(srcva);
-    pa0 = walkaddr(pagetable, va0);
-    if(pa0 == 0)
+    if((pa0 = uwalkpa(&w, va0, 0)) == 0)
       return -1;
     n = PGSIZE - (srcva - va0);
     if(n > max)
       n = max;
 
     char *p = (char *) (pa0 + (srcva - va0));
-    while(n > 0){
-      if(*p == '\0'){
-        *dst = '\0';
-        got_null = 1;
-        break;
-      } else {
-        *dst = *p;
-      }
-      --n;
-      --max;
-      p++;
-      dst++;
+    m = strnlen8(p, n);
+    memmove(dst, p, m);
+    if(m < n){
+      dst[m] = '\0';
+      return 0;
     }
-
+    max -= n;
+    dst += n;
     srcva = va0 + PGSIZE;
   }
-  if(got_null){
-    return 0;
-  } else {
-    return -1;
-  }
+  return -1;
 }
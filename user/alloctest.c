@@ -102,10 +102,106 @@ void test1()
   }
 }
 
+// Stress the kernel's slab and buddy allocators: several
+// processes at once repeatedly open and close batches of
+// pipes and files, which come from slab caches.
+void test2()
+{
+  enum { NCHILD = 4, NITER = 500, NPIPE = 4, NFD = 4 };
+  int fds[NPIPE][2], fd[NFD];
+  int i, j, start;
+
+  printf("bdtest: start\n");
+  start = uptime();
+  for(i = 0; i < NCHILD; i++){
+    int pid = fork();
+    if(pid < 0){
+      printf("fork failed");
+      exit(1);
+    }
+    if(pid == 0){
+      for(int n = 0; n < NITER; n++){
+        for(j = 0; j < NPIPE; j++)
+          if(pipe(fds[j]) != 0)
+            exit(1);
+        for(j = 0; j < NFD; j++)
+          if((fd[j] = open("README", O_RDONLY)) < 0)
+            exit(1);
+        for(j = 0; j < NPIPE; j++){
+          close(fds[j][0]);
+          close(fds[j][1]);
+        }
+        for(j = 0; j < NFD; j++)
+          close(fd[j]);
+      }
+      exit(0);
+    }
+  }
+
+  int all_ok = 1;
+  for(i = 0; i < NCHILD; i++){
+    int xstatus;
+    wait(&xstatus);
+    if(xstatus != 0)
+      all_ok = 0;
+  }
+  if(all_ok)
+    printf("bdtest: OK (%d ticks)\n", uptime() - start);
+  else
+    printf("bdtest: FAILED\n");
+}
+
+// Split and merge buddy blocks of many sizes: several
+// processes at once run the kernel's bdtest(), which allocates
+// and frees random-sized blocks straight from the buddy
+// allocator (user memory comes from kalloc(), not buddy). When
+// they are done, the free bytes and the largest free block
+// must be what they were before, so every split was merged.
+void test3()
+{
+  enum { NCHILD = 4, NOPS = 5000 };
+  int i, free0, big0, free1, big1;
+
+  printf("bdmerge: start\n");
+  free0 = bdtest(0);
+  big0 = bdtest(-1);
+  for(i = 0; i < NCHILD; i++){
+    int pid = fork();
+    if(pid < 0){
+      printf("fork failed");
+      exit(1);
+    }
+    if(pid == 0)
+      exit(bdtest(NOPS) == 0 ? 0 : 1);
+  }
+
+  int all_ok = 1;
+  for(i = 0; i < NCHILD; i++){
+    int xstatus;
+    wait(&xstatus);
+    if(xstatus != 0)
+      all_ok = 0;
+  }
+  if(!all_ok){
+    printf("bdmerge: FAILED, a block was overwritten\n");
+    return;
+  }
+  free1 = bdtest(0);
+  big1 = bdtest(-1);
+  if(free1 != free0 || big1 != big0){
+    printf("bdmerge: FAILED, free %d -> %d, largest block %d -> %d\n",
+           free0, free1, big0, big1);
+    return;
+  }
+  printf("bdmerge: OK\n");
+}
+
 int
 main(int argc, char *argv[])
 {
   test0();
   test1();
+  test2();
+  test3();
   exit(0);
 }
@@ -8,12 +8,14 @@
 
 void test0();
 void test1();
+void test2();
 
 int
 main(int argc, char *argv[])
 {
   test0();
   test1();
+  test2();
   exit(0);
 }
 
@@ -167,3 +169,64 @@ void test1()
   }
   printf("test1 OK\n");
 }
+
+// Read a file much bigger than the buffer cache with one
+// large read(), and check that it gets the right data and
+// isn't slower than reading it a block at a time: blocks read
+// ahead must not be evicted before the read reaches them.
+void test2()
+{
+  enum { BIG = 1000 };
+  char buf[BSIZE];
+  char *big;
+  int fd, i, t0, tblk, tbig;
+
+  printf("start test2\n");
+  unlink("R");
+  if((fd = open("R", O_CREATE | O_RDWR)) < 0){
+    printf("test2 create R failed\n");
+    exit(-1);
+  }
+  for(i = 0; i < BIG; i++){
+    memset(buf, i, BSIZE);
+    if(write(fd, buf, BSIZE) != BSIZE){
+      printf("write R failed\n");
+      exit(-1);
+    }
+  }
+  close(fd);
+
+  t0 = uptime();
+  readfile("R", BIG*BSIZE, BSIZE);
+  tblk = uptime() - t0;
+
+  if((big = sbrk(BIG*BSIZE)) == (char*)-1){
+    printf("test2 sbrk failed\n");
+    exit(-1);
+  }
+  if((fd = open("R", O_RDONLY)) < 0){
+    printf("test2 open R failed\n");
+    exit(-1);
+  }
+  t0 = uptime();
+  if(read(fd, big, BIG*BSIZE) != BIG*BSIZE){
+    printf("read R failed\n");
+    exit(-1);
+  }
+  tbig = uptime() - t0;
+  close(fd);
+  unlink("R");
+  for(i = 0; i < BIG*BSIZE; i++){
+    if(big[i] != (char)(i / BSIZE)){
+      printf("test2: FAIL, wrong data in block %d\n", i / BSIZE);
+      exit(-1);
+    }
+  }
+  sbrk(-BIG*BSIZE);
+
+  printf("test2: %d ticks block by block, %d ticks in one read\n", tblk, tbig);
+  if(tbig > tblk + tblk/2 + 1)
+    printf("test2: FAIL\n");
+  else
+    printf("test2: OK\n");
+}
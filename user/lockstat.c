@@ -0,0 +1,100 @@
+#include "kernel/param.h"
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/fcntl.h"
+#include "kernel/lockstat.h"
+#include "user/user.h"
+
+// Print the most contended kernel locks, from the lock
+// statistics device.
+//
+//   lockstat [-z] [n]
+//
+// shows the top n (default 10) locks by test-and-set spins;
+// -z clears the statistics instead.
+
+#define MAXLOCKS 1000
+
+struct lockstat st[MAXLOCKS];
+struct lockstat *sorted[MAXLOCKS];
+
+// the device node; not "lockstat", which is this program.
+#define DEVPATH "/lockstatdev"
+
+int
+opendev(int mode)
+{
+  int fd;
+  struct stat sb;
+
+  if((fd = open(DEVPATH, mode)) < 0){
+    mknod(DEVPATH, LOCKSTAT, 0);
+    fd = open(DEVPATH, mode);
+  }
+  if(fd < 0){
+    fprintf(2, "lockstat: cannot open %s\n", DEVPATH);
+    exit(1);
+  }
+  if(fstat(fd, &sb) < 0 || sb.type != T_DEVICE){
+    fprintf(2, "lockstat: %s is not a device\n", DEVPATH);
+    exit(1);
+  }
+  return fd;
+}
+
+// print v, which may not fit in an int, as a count of kilocycles.
+void
+printk(uint64 v)
+{
+  printf("%dk", (int)(v / 1000));
+}
+
+int
+main(int argc, char *argv[])
+{
+  int fd, n, i, j, top, busiest;
+  struct lockstat *l;
+
+  if(argc > 1 && strcmp(argv[1], "-z") == 0){
+    fd = opendev(O_WRONLY);
+    write(fd, "z", 1);
+    close(fd);
+    exit(0);
+  }
+  top = argc > 1 ? atoi(argv[1]) : 10;
+
+  fd = opendev(O_RDONLY);
+  n = read(fd, st, sizeof(st)) / sizeof(st[0]);
+  close(fd);
+
+  // insertion sort by spins, most contended first, then by
+  // acquires, so that locks never acquired come last.
+  for(i = 0; i < n; i++){
+    for(j = i; j > 0 && (sorted[j-1]->nts < st[i].nts ||
+                         (sorted[j-1]->nts == st[i].nts && sorted[j-1]->n < st[i].n)); j--)
+      sorted[j] = sorted[j-1];
+    sorted[j] = &st[i];
+  }
+
+  printf("name            acquires    spins  avg-hold max-hold busiest-cpu sleep-waits avg-wait\n");
+  for(i = 0; i < n && i < top; i++){
+    l = sorted[i];
+    if(l->n == 0)
+      break;  // so are all the rest
+    busiest = 0;
+    for(j = 1; j < NCPU; j++)
+      if(l->ncpu[j] > l->ncpu[busiest])
+        busiest = j;
+    printf("%s ", l->name);
+    for(j = strlen(l->name); j < 15; j++)
+      printf(" ");
+    printf("%d %d ", l->n, l->nts);
+    printk(l->hold / l->n);
+    printf(" ");
+    printk(l->maxhold);
+    printf(" %d(%d%%) %d ", busiest, (int)((uint64)l->ncpu[busiest] * 100 / l->n), l->nsleep);
+    printk(l->nsleep ? l->sleepwait / l->nsleep : 0);
+    printf("\n");
+  }
+  exit(0);
+}
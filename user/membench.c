@@ -0,0 +1,136 @@
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "user/user.h"
+
+// Time memmove, memset and memcmp on page-sized buffers against
+// plain byte loops, and check that they give the same results.
+
+#define SZ 4096
+#define N 20000
+
+char a[SZ + 8], b[SZ + 8];
+
+void
+bytemove(char *d, char *s, int n)
+{
+  while(n-- > 0)
+    *d++ = *s++;
+}
+
+void
+byteset(char *d, int c, int n)
+{
+  while(n-- > 0)
+    *d++ = c;
+}
+
+int
+bytecmp(char *p, char *q, int n)
+{
+  for(; n > 0; n--, p++, q++)
+    if(*p != *q)
+      return (uchar)*p - (uchar)*q;
+  return 0;
+}
+
+// Check memmove(w + d, w + s, n) against a byte loop that
+// copies through t, which is right even when the ranges overlap.
+char w[SZ + 64], r[SZ + 64], t[SZ];
+
+void
+checkmove(int d, int s, int n)
+{
+  int i;
+
+  for(i = 0; i < sizeof(w); i++)
+    w[i] = r[i] = i * 7 + d + s;
+  bytemove(t, r + s, n);
+  bytemove(r + d, t, n);
+  memmove(w + d, w + s, n);
+  if(bytecmp(w, r, sizeof(w)) != 0){
+    printf("membench: memmove(w+%d, w+%d, %d) wrong\n", d, s, n);
+    exit(-1);
+  }
+}
+
+void
+check(void)
+{
+  static int lens[] = { 1, 7, 8, 63, 64, 65, 200, SZ - 64 };
+  int i, j, k, m, n, off;
+
+  for(m = 0; m < 8; m++){
+    for(k = 0; k < sizeof(lens)/sizeof(lens[0]); k++){
+      n = lens[k];
+      // source and destination equally aligned, a whole number
+      // of words apart: the word and unrolled loops, forwards
+      // and backwards, over overlapping ranges.
+      for(j = 1; j <= 4; j++){
+        checkmove(m + 8*j, m, n);
+        checkmove(m, m + 8*j, n);
+      }
+      // differently aligned: the byte loops.
+      checkmove(m + 3, m, n);
+      checkmove(m, m + 3, n);
+    }
+    // far apart, so the ranges don't overlap.
+    checkmove(m + SZ/2 + 8, m, SZ/2 - 16);
+    checkmove(m, m + SZ/2 + 8, SZ/2 - 16);
+  }
+
+  for(off = 0; off < 8; off++){
+    for(i = 0; i < SZ; i++)
+      a[i] = i * 7 + off;
+    memmove(b + off, a, SZ);
+    if(memcmp(b + off, a, SZ) != 0){
+      printf("membench: memcmp wrong at offset %d\n", off);
+      exit(-1);
+    }
+    b[off + SZ/2]++;
+    if(memcmp(b + off, a, SZ) <= 0){
+      printf("membench: memcmp wrong at offset %d\n", off);
+      exit(-1);
+    }
+    memset(b + off, off, SZ);
+    for(i = 0; i < SZ; i++){
+      if(b[off + i] != off){
+        printf("membench: memset wrong at offset %d\n", off);
+        exit(-1);
+      }
+    }
+  }
+}
+
+void
+bench(char *name, void (*f)(int), void (*g)(int))
+{
+  int t0, t1, t2, i;
+
+  t0 = uptime();
+  for(i = 0; i < N; i++)
+    f(i);
+  t1 = uptime();
+  for(i = 0; i < N; i++)
+    g(i);
+  t2 = uptime();
+  printf("%s: %d ticks, byte loop %d ticks\n", name, t1 - t0, t2 - t1);
+}
+
+void fmove(int i) { memmove(b, a, SZ); }
+void gmove(int i) { bytemove(b, a, SZ); }
+void fset(int i) { memset(b, i, SZ); }
+void gset(int i) { byteset(b, i, SZ); }
+void fcmp(int i) { if(memcmp(b, a, SZ) != 0) exit(-1); }
+void gcmp(int i) { if(bytecmp(b, a, SZ) != 0) exit(-1); }
+
+int
+main(int argc, char *argv[])
+{
+  check();
+  bench("memmove", fmove, gmove);
+  bench("memset", fset, gset);
+  memmove(b, a, SZ);
+  bench("memcmp", fcmp, gcmp);
+  printf("membench: ok\n");
+  exit(0);
+}
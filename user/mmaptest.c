@@ -8,6 +8,7 @@
 
 void mmap_test();
 void fork_test();
+void fork_write_test();
 char buf[BSIZE];
 
 #define MAP_FAILED ((char *) -1)
@@ -17,6 +18,7 @@ main(int argc, char *argv[])
 {
   mmap_test();
   fork_test();
+  fork_write_test();
   printf("mmaptest: all tests succeeded\n");
   exit(0);
 }
@@ -269,3 +271,71 @@ fork_test(void)
   printf("fork_test OK\n");
 }
 
+
+//
+// write to a MAP_SHARED and a MAP_PRIVATE mapping, then fork.
+// the child must see the parent's stores, and a child that
+// only read a shared page must not write an old copy of it
+// back over the parent's data when it exits.
+//
+void
+fork_write_test(void)
+{
+  int fd, pid, fds[2];
+  char c;
+  const char * const f = "mmap.dur";
+
+  printf("fork_write_test starting\n");
+  testname = "fork_write_test";
+
+  makefile(f);
+  if ((fd = open(f, O_RDWR)) == -1)
+    err("open");
+  char *p1 = mmap(0, PGSIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (p1 == MAP_FAILED)
+    err("mmap (1)");
+  char *p2 = mmap(0, PGSIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  if (p2 == MAP_FAILED)
+    err("mmap (2)");
+  close(fd);
+  p1[0] = 'B';
+  p2[0] = 'C';
+
+  if (pipe(fds) < 0)
+    err("pipe");
+  if ((pid = fork()) < 0)
+    err("fork");
+  if (pid == 0) {
+    if (p1[0] != 'B' || p2[0] != 'C')
+      exit(1);
+    // a store to the private page must not reach the parent.
+    p2[0] = 'D';
+    // exit, writing back, only after the parent has.
+    close(fds[1]);
+    read(fds[0], &c, 1);
+    exit(0);
+  }
+  close(fds[0]);
+  if (munmap(p1, PGSIZE) == -1)
+    err("munmap");
+  if (p2[0] != 'C')
+    err("private page changed by child");
+  close(fds[1]);
+
+  int status = -1;
+  wait(&status);
+  if (status != 0)
+    err("child didn't see the parent's stores");
+
+  if ((fd = open(f, O_RDONLY)) == -1)
+    err("open");
+  if (read(fd, &c, 1) != 1)
+    err("read");
+  close(fd);
+  if (c != 'B')
+    err("parent's store was lost");
+  munmap(p2, PGSIZE);
+  unlink(f);
+
+  printf("fork_write_test OK\n");
+}
@@ -32,14 +32,40 @@ strlen(const char *s)
   return n;
 }
 
+// memset, memcmp and memmove work a 64-bit word at a time
+// once the pointers are aligned, eight words per iteration on
+// large buffers, and a byte at a time only at the ends or
+// when the two pointers are not aligned alike.
+
+#define WSIZE sizeof(uint64)
+#define WMASK (WSIZE - 1)
+
 void*
 memset(void *dst, int c, uint n)
 {
-  char *cdst = (char *) dst;
-  int i;
-  for(i = 0; i < n; i++){
-    cdst[i] = c;
+  uchar *d = (uchar *) dst;
+  uint64 w, *wd;
+
+  while(n > 0 && ((uint64)d & WMASK)){
+    *d++ = c;
+    n--;
   }
+  if(n >= WSIZE){
+    w = (uchar)c;
+    w |= w << 8;
+    w |= w << 16;
+    w |= w << 32;
+    wd = (uint64 *) d;
+    for(; n >= 8*WSIZE; n -= 8*WSIZE, wd += 8){
+      wd[0] = w; wd[1] = w; wd[2] = w; wd[3] = w;
+      wd[4] = w; wd[5] = w; wd[6] = w; wd[7] = w;
+    }
+    for(; n >= WSIZE; n -= WSIZE)
+      *wd++ = w;
+    d = (uchar *) wd;
+  }
+  while(n-- > 0)
+    *d++ = c;
   return dst;
 }
 
@@ -96,36 +122,90 @@ atoi(const char *s)
 }
 
 void*
-memmove(void *vdst, const void *vsrc, int n)
+memmove(void *dst, const void *src, int n)
 {
-  char *dst;
-  const char *src;
-
-  dst = vdst;
-  src = vsrc;
-  if (src > dst) {
+  const uchar *s;
+  uchar *d;
+  const uint64 *ws;
+  uint64 *wd;
+  int aligned;
+
+  if(n <= 0)
+    return dst;
+  s = src;
+  d = dst;
+  aligned = (((uint64)s ^ (uint64)d) & WMASK) == 0;
+  if(s < d && s + n > d){
+    // overlapping, with dst above src: copy backwards.
+    s += n;
+    d += n;
+    if(aligned){
+      while(n > 0 && ((uint64)d & WMASK)){
+        *--d = *--s;
+        n--;
+      }
+      ws = (const uint64 *) s;
+      wd = (uint64 *) d;
+      for(; n >= 8*WSIZE; n -= 8*WSIZE){
+        ws -= 8, wd -= 8;
+        wd[7] = ws[7]; wd[6] = ws[6]; wd[5] = ws[5]; wd[4] = ws[4];
+        wd[3] = ws[3]; wd[2] = ws[2]; wd[1] = ws[1]; wd[0] = ws[0];
+      }
+      for(; n >= WSIZE; n -= WSIZE)
+        *--wd = *--ws;
+      s = (const uchar *) ws;
+      d = (uchar *) wd;
+    }
     while(n-- > 0)
-      *dst++ = *src++;
+      *--d = *--s;
   } else {
-    dst += n;
-    src += n;
+    if(aligned){
+      while(n > 0 && ((uint64)d & WMASK)){
+        *d++ = *s++;
+        n--;
+      }
+      ws = (const uint64 *) s;
+      wd = (uint64 *) d;
+      for(; n >= 8*WSIZE; n -= 8*WSIZE, ws += 8, wd += 8){
+        wd[0] = ws[0]; wd[1] = ws[1]; wd[2] = ws[2]; wd[3] = ws[3];
+        wd[4] = ws[4]; wd[5] = ws[5]; wd[6] = ws[6]; wd[7] = ws[7];
+      }
+      for(; n >= WSIZE; n -= WSIZE)
+        *wd++ = *ws++;
+      s = (const uchar *) ws;
+      d = (uchar *) wd;
+    }
     while(n-- > 0)
-      *--dst = *--src;
+      *d++ = *s++;
   }
-  return vdst;
+
+  return dst;
 }
 
 int
-memcmp(const void *s1, const void *s2, uint n)
+memcmp(const void *v1, const void *v2, uint n)
 {
-  const char *p1 = s1, *p2 = s2;
-  while (n-- > 0) {
-    if (*p1 != *p2) {
-      return *p1 - *p2;
+  const uchar *s1, *s2;
+
+  s1 = v1;
+  s2 = v2;
+  if((((uint64)s1 ^ (uint64)s2) & WMASK) == 0){
+    while(n > 0 && ((uint64)s1 & WMASK)){
+      if(*s1 != *s2)
+        return *s1 - *s2;
+      s1++, s2++, n--;
     }
-    p1++;
-    p2++;
+    // skip equal words; the bytes below find the difference.
+    while(n >= WSIZE && *(uint64 *)s1 == *(uint64 *)s2){
+      s1 += WSIZE, s2 += WSIZE, n -= WSIZE;
+    }
+  }
+  while(n-- > 0){
+    if(*s1 != *s2)
+      return *s1 - *s2;
+    s1++, s2++;
   }
+
   return 0;
 }
 
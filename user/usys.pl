@@ -37,3 +37,8 @@ entry("sbrk");
 entry("sleep");
 entry("uptime");
 entry("ntas");
+entry("mmap");
+entry("munmap");
+entry("fsync");
+entry("sync");
+entry("bdtest");